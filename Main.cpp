@@ -1,8 +1,16 @@
 #include "SmartTaskManager.h"
+#include "TaskServer.h"
+#include "TaskLogStorage.h"
+#include "TaskShards.h"
+#include "TaskOutput.h"
 #include <limits>
 #include <cctype>
 #include <vector>
 #include <algorithm>
+#include <memory>
+#include <ctime>
+#include <fstream>
+#include <stdexcept>
 #include <sqlite3.h>
 
 // Helper function to safely read an integer
@@ -41,31 +49,414 @@ char getYesNoInput(const string &prompt) {
     return 'n'; // default (should never reach here)
 }
 
-int main() {
-    AVLTree tree;
-    // Load tasks from the database and rebuild the AVL tree.
-    vector<Task> tasks;
+// Highest menu option; Exit stays at 6 and newer options follow it.
+const int LAST_CHOICE = 13;
+
+// Helper function to read the status filter: incomplete, complete or any
+optional<TaskStatus> getStatusFilter(const string &prompt) {
+    char answer;
+    while (true) {
+        cout << prompt;
+        cin >> answer;
+        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        answer = tolower(answer);
+        if (answer == 'i')
+            return TaskStatus::Incomplete;
+        if (answer == 'c')
+            return TaskStatus::Complete;
+        if (answer == 'a')
+            return nullopt;
+        cout << "Invalid input. Please enter i, c or a.\n";
+        cin.clear();
+    }
+}
+
+// Builds a new incomplete task due in the given time, next in sequence.
+Task makeTask(const AVLTree &tree, string id, string desc, const string &category,
+              int years, int months, int days, int hours) {
+    return Task::dueIn(std::move(id), std::move(desc), category, years, months, days, hours, tree.nextSequence());
+}
+
+// Splits one CSV line into fields. Fields may be double-quoted, with "" for a
+// literal quote, so descriptions can contain commas.
+vector<string> splitCsvLine(const string &line) {
+    vector<string> fields;
+    string field;
+    bool quoted = false;
+    for (size_t i = 0; i < line.size(); i++) {
+        char c = line[i];
+        if (quoted) {
+            if (c == '"' && i + 1 < line.size() && line[i + 1] == '"') {
+                field += '"';
+                i++;
+            } else if (c == '"') {
+                quoted = false;
+            } else {
+                field += c;
+            }
+        } else if (c == '"') {
+            quoted = true;
+        } else if (c == ',') {
+            fields.push_back(field);
+            field.clear();
+        } else if (c != '\r') {
+            field += c;
+        }
+    }
+    fields.push_back(field);
+    return fields;
+}
+
+int parseIntField(const string &field) {
+    size_t used = 0;
+    int value = stoi(field, &used);
+    if (used != field.size())
+        throw invalid_argument("not a number: " + field);
+    return value;
+}
+
+// Applies one batch operation to the tree; throws on a bad or failed operation.
+//   insert,<id>,<description>,<category>,<years>,<months>,<days>,<hours>
+//   status,<id>,complete|incomplete
+//   delete,<id>
+//   recompute   (re-derives every task's remaining hours from its due time)
+void applyBatchOperation(AVLTree &tree, const vector<string> &fields) {
+    const string &op = fields[0];
+    if (op == "insert" && fields.size() == 8) {
+        tree.insert(makeTask(tree, fields[1], fields[2], fields[3], parseIntField(fields[4]),
+                             parseIntField(fields[5]), parseIntField(fields[6]), parseIntField(fields[7])));
+    } else if (op == "status" && fields.size() == 3 && (fields[2] == "complete" || fields[2] == "incomplete")) {
+        tree.updateTaskStatus(fields[1], parseStatus(fields[2]));
+    } else if (op == "delete" && fields.size() == 2) {
+        tree.deleteTask(fields[1]);
+    } else if (op == "recompute" && fields.size() == 1) {
+        tree.recomputeDeadlines(time(nullptr));
+    } else {
+        throw invalid_argument("unrecognised operation");
+    }
+}
+
+// Non-interactive mode: applies every operation in the CSV file (or stdin for
+// "-") to the tree, then writes the net change in one transaction.
+// Blank lines and lines starting with # are skipped; a failing line is
+// reported and skipped. Returns the process exit code.
+int runBatch(const string &path, AVLTree &tree, TaskStorage &storage) {
+    ifstream file;
+    if (path != "-") {
+        file.open(path);
+        if (!file) {
+            cout << "Can't open batch file: " << path << "\n";
+            return 1;
+        }
+    }
+    istream &in = path == "-" ? cin : file;
+
+    ChangeRecorder recorder;
+    tree.setJournal(&recorder);
+    size_t applied = 0, failed = 0, lineNumber = 0;
+    string line;
+    while (getline(in, line)) {
+        lineNumber++;
+        if (line.empty() || line[0] == '#' || line == "\r")
+            continue;
+        try {
+            applyBatchOperation(tree, splitCsvLine(line));
+            applied++;
+        } catch (const exception &e) {
+            cout << "Line " << lineNumber << ": " << e.what() << "\n";
+            failed++;
+        }
+    }
+    tree.setJournal(nullptr);
+
+    try {
+        storage.writeChanges(recorder.changes);
+    } catch (const runtime_error &e) {
+        cout << "Database error: " << e.what() << "\n";
+        return 1;
+    }
+    cout << "Applied " << applied << " operation(s), " << failed << " failed; "
+         << recorder.changes.size() << " row(s) written.\n";
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    // Nothing here writes through stdio, so cout can keep its own buffer
+    // instead of syncing with stdout on every insertion.
+    ios::sync_with_stdio(false);
+    string batchPath;
+    int servePort = -1;
+    bool logStorage = false;
+    long hotSetCapacity = 0;
+    long archiveAfterDays = 0;
+    long undoSteps = 0;
+    string team = TaskShards::DEFAULT_TEAM;
+    TaskOrder order;
+    unordered_map<string, TaskOrder> teamOrders;
+    OutputFormat format = OutputFormat::Text;
+    bool listOnly = false;
+    ServerProfile serverProfile;
+    const vector<string> options = {"--storage", "--team", "--hot-set", "--archive-after", "--order", "--team-order",
+                                    "--format", "--listen", "--serve-teams", "--undo"};
+    int arg = 1;
+    while (arg + 1 < argc && find(options.begin(), options.end(), argv[arg]) != options.end()) {
+        string value = argv[arg + 1];
+        if (string(argv[arg]) == "--listen") {
+            serverProfile.address = value;
+        } else if (string(argv[arg]) == "--serve-teams") {
+            // Comma-separated; * lets clients open any team.
+            size_t start = 0;
+            while (start <= value.size()) {
+                size_t comma = min(value.find(',', start), value.size());
+                string name = value.substr(start, comma - start);
+                if (name != "*" && !TaskShards::validTeamName(name)) {
+                    cout << "Invalid team name: " << name << "\n";
+                    return 1;
+                }
+                serverProfile.teams.push_back(name);
+                start = comma + 1;
+            }
+        } else if (string(argv[arg]) == "--format") {
+            try {
+                format = parseOutputFormat(value);
+            } catch (const runtime_error &e) {
+                cout << e.what() << "\n";
+                return 1;
+            }
+        } else if (string(argv[arg]) == "--order" || string(argv[arg]) == "--team-order") {
+            // --team-order <team>=<order>: team names never contain '='.
+            bool forTeam = string(argv[arg]) == "--team-order";
+            size_t equals = forTeam ? value.find('=') : string::npos;
+            if (forTeam && (equals == string::npos || !TaskShards::validTeamName(value.substr(0, equals)))) {
+                cout << "Expected <team>=<order>: " << value << "\n";
+                return 1;
+            }
+            try {
+                TaskOrder parsed = TaskOrder::parse(forTeam ? value.substr(equals + 1) : value);
+                if (forTeam)
+                    teamOrders[value.substr(0, equals)] = parsed;
+                else
+                    order = parsed;
+            } catch (const runtime_error &e) {
+                cout << e.what() << "\n";
+                return 1;
+            }
+        } else if (string(argv[arg]) == "--archive-after") {
+            try {
+                archiveAfterDays = parseIntField(value);
+            } catch (const exception &) {
+                archiveAfterDays = 0;
+            }
+            if (archiveAfterDays <= 0) {
+                cout << "Invalid archive age in days: " << value << "\n";
+                return 1;
+            }
+        } else if (string(argv[arg]) == "--undo") {
+            try {
+                undoSteps = parseIntField(value);
+            } catch (const exception &) {
+                undoSteps = 0;
+            }
+            if (undoSteps <= 0) {
+                cout << "Invalid number of undo steps: " << value << "\n";
+                return 1;
+            }
+        } else if (string(argv[arg]) == "--hot-set") {
+            try {
+                hotSetCapacity = parseIntField(value);
+            } catch (const exception &) {
+                hotSetCapacity = 0;
+            }
+            if (hotSetCapacity <= 0) {
+                cout << "Invalid hot-set size: " << value << "\n";
+                return 1;
+            }
+        } else if (string(argv[arg]) == "--team") {
+            if (!TaskShards::validTeamName(value)) {
+                cout << "Invalid team name: " << value << "\n";
+                return 1;
+            }
+            team = value;
+        } else if (value == "sqlite" || value == "log") {
+            logStorage = value == "log";
+        } else {
+            cout << "Unknown storage: " << value << "\n";
+            return 1;
+        }
+        arg += 2;
+    }
+    if (hotSetCapacity > 0 && logStorage) {
+        cout << "--hot-set needs the sqlite storage.\n";
+        return 1;
+    }
+    if (hotSetCapacity > 0 && undoSteps > 0) {
+        cout << "--undo keeps a versioned copy of every task and cannot be used with --hot-set.\n";
+        return 1;
+    }
+    if (undoSteps > 0 && archiveAfterDays > 0) {
+        cout << "--undo could bring back tasks already archived and cannot be used with --archive-after.\n";
+        return 1;
+    }
+    if (hotSetCapacity > 0 && archiveAfterDays > 0) {
+        cout << "--archive-after scans the tasks in memory and cannot be used with --hot-set.\n";
+        return 1;
+    }
+    auto hasMode = [&](const char* mode) { return find(argv + arg, argv + argc, string(mode)) != argv + argc; };
+    if (hasMode("--batch") && hasMode("--serve")) {
+        cout << "--batch exits once its operations are applied and cannot be used with --serve.\n";
+        return 1;
+    }
+    if (argc - arg == 1 && string(argv[arg]) == "--list") {
+        listOnly = true;
+    } else if (argc - arg == 2 && string(argv[arg]) == "--batch") {
+        batchPath = argv[arg + 1];
+    } else if (argc - arg == 2 && string(argv[arg]) == "--serve") {
+        try {
+            servePort = parseIntField(argv[arg + 1]);
+        } catch (const exception &) {
+        }
+        if (servePort < 0 || servePort > 65535) {
+            cout << "Invalid port: " << argv[arg + 1] << "\n";
+            return 1;
+        }
+    } else if (argc != arg) {
+        cout << "Usage: " << argv[0] << " [--storage sqlite|log] [--team <name>] [--hot-set <complete tasks>] [--archive-after <days>]\n"
+             << "       [--order <order>] [--team-order <team>=<order>] [--undo <steps>]\n"
+             << "       [--format text|tsv|json] [--listen <address>] [--serve-teams <team>,...|*]\n"
+             << "       [--list | --batch <operations.csv | -> | --serve <port>]\n"
+             << "<order> is deadline (default), due, or category:<name>=<weight>,... (heaviest first).\n";
+        return 1;
+    }
+    // Batch mode applies the file to a plain tree and writes it straight to
+    // storage, without the store these options configure.
+    if (!batchPath.empty() && hotSetCapacity > 0) {
+        cout << "--batch loads every task and cannot be used with --hot-set.\n";
+        return 1;
+    }
+    if (!batchPath.empty() && undoSteps > 0) {
+        cout << "--batch keeps no undo history and cannot be used with --undo.\n";
+        return 1;
+    }
+    if (!batchPath.empty() && archiveAfterDays > 0) {
+        cout << "--batch does not run the archiver and cannot be used with --archive-after.\n";
+        return 1;
+    }
+
+    // Every team has its own table (its own files with the log backend); the
+    // default team keeps the original ones.
+    auto openStorage = [logStorage](const string &name) -> unique_ptr<TaskStorage> {
+        bool isDefault = name == TaskShards::DEFAULT_TEAM;
+        if (!logStorage)
+            return unique_ptr<TaskStorage>(new DBManager("database.db", StorageProfile(), isDefault ? "data" : "data_" + name));
+        unique_ptr<LogStorage> log(new LogStorage(isDefault ? "tasks" : "tasks_" + name));
+        // The first run with the log backend imports the SQLite tasks.
+        if (isDefault && !log->hasData())
+            log->replaceAll(DBManager("database.db").loadTasks());
+        return unique_ptr<TaskStorage>(std::move(log));
+    };
+
+    if (listOnly) {
+        // Every task in priority order, nothing else, for piping. Sorting
+        // the keys is enough; building a tree (and its indexes) is not needed.
+        try {
+            TaskOrder teamOrder = teamOrders.count(team) ? teamOrders[team] : order;
+            vector<Task> tasks = openStorage(team)->loadTasks();
+            vector<pair<OrderKey, size_t>> keys;
+            keys.reserve(tasks.size());
+            for (size_t i = 0; i < tasks.size(); i++)
+                keys.emplace_back(teamOrder.keyOf(tasks[i]), i);
+            sort(keys.begin(), keys.end(), [](const pair<OrderKey, size_t>& a, const pair<OrderKey, size_t>& b) {
+                return a.first < b.first;
+            });
+            TaskWriter writer(cout, format);
+            for (size_t i = 0; i < keys.size(); i++)
+                writer.write(tasks[keys[i].second], static_cast<int>(i) + 1);
+            return 0;
+        } catch (const runtime_error &e) {
+            cout << "Error loading tasks from database: " << e.what() << "\n";
+            return 1;
+        }
+    }
+    if (!batchPath.empty()) {
+        try {
+            unique_ptr<TaskStorage> storage = openStorage(team);
+            AVLTree tree;
+            tree.setOrder(teamOrders.count(team) ? teamOrders[team] : order);
+            tree.rebuild(storage->loadTasks());
+            return runBatch(batchPath, tree, *storage);
+        } catch (const runtime_error &e) {
+            cout << "Error loading tasks from database: " << e.what() << "\n";
+            return 1;
+        }
+    }
+
+    // Shared by the menu and, with --serve, the network server thread. Each
+    // team is loaded on first use; its journal writes changes to its storage
+    // in the background. With --hot-set only incomplete and recently used
+    // complete tasks are kept in memory.
+    TaskShards shards(openStorage, static_cast<size_t>(hotSetCapacity));
+    shards.setOrder(order);
+    for (const auto &entry : teamOrders)
+        shards.setTeamOrder(entry.first, entry.second);
+    // With --undo, listing walks a snapshot instead of holding the lock, and
+    // menu option 13 reverts the team's last changes, whoever made them.
+    if (undoSteps > 0)
+        shards.enableUndo(static_cast<size_t>(undoSteps));
+    if (archiveAfterDays > 0) {
+        // Old complete tasks move to the same table names in archive.db.
+        ArchiveProfile profile;
+        profile.minAgeSeconds = archiveAfterDays * 24LL * 3600;
+        shards.enableArchive([](const string &name) {
+            return unique_ptr<DBManager>(new DBManager("archive.db", StorageProfile(),
+                                                       name == TaskShards::DEFAULT_TEAM ? "data" : "data_" + name));
+        }, profile);
+    }
+    TaskShard *shard;
     try {
-        tasks = DBManager::loadTasks();
+        shard = &shards.shard(team);
     } catch (const runtime_error &e) {
         cout << "Error loading tasks from database: " << e.what() << "\n";
+        return 1;
+    }
+    unique_ptr<TaskServer> server;
+    if (servePort >= 0) {
+        try {
+            server.reset(new TaskServer(shards, team, static_cast<uint16_t>(servePort), serverProfile));
+            cout << "Serving tasks on " << serverProfile.address << " port " << server->port() << ".\n";
+        } catch (const runtime_error &e) {
+            cout << e.what() << "\n";
+            return 1;
+        }
     }
-    tree.rebuild(tasks);
+    // Reminders follow the team the menu is on.
+    optional<DeadlineScheduler> scheduler;
+    auto startScheduler = [&]() {
+        shard->store.read([&](const AVLTree &tree) { scheduler.emplace(tree, time(nullptr)); });
+    };
+    startScheduler();
 
     while (true) {
+        shard->store.read([&scheduler](const AVLTree &) {
+            return scheduler->sweep(time(nullptr), [](const Task& t) {
+                cout << "\nReminder: task " << t.id << " (" << t.description << ") is now overdue.\n";
+            });
+        });
+
         cout << "\n----- SMART TASK MANAGER -----\n";
-        cout << "1. Insert Task\n2. Update Task Status\n3. Delete Task\n4. Search Task\n5. List Tasks\n6. Exit\nChoice: ";
+        cout << "1. Insert Task\n2. Update Task Status\n3. Delete Task\n4. Search Task\n5. List Tasks\n6. Exit\n"
+             << "7. Filter Tasks\n8. Upcoming Deadlines\n9. Statistics\n10. Keyword Search\n11. Switch Team\n"
+             << "12. Archived Tasks\n13. Undo\nChoice: ";
         int choice;
     while (true) {
-        cout << "Enter your choice (1-6): ";
+        cout << "Enter your choice (1-" << LAST_CHOICE << "): ";
         if (!(cin >> choice)) {
-            cout << "Invalid input. Please enter a number between 1 and 6." << endl;
+            cout << "Invalid input. Please enter a number between 1 and " << LAST_CHOICE << "." << endl;
             cin.clear();
             cin.ignore(numeric_limits<streamsize>::max(), '\n');
             continue;
         }
-        if (choice < 1 || choice > 6) {
-            cout << "Choice should be from 1 to 6. Try Again." << endl;
+        if (choice < 1 || choice > LAST_CHOICE) {
+            cout << "Choice should be from 1 to " << LAST_CHOICE << ". Try Again." << endl;
             cin.ignore(numeric_limits<streamsize>::max(), '\n');
             continue;
         }
@@ -79,7 +470,7 @@ int main() {
             getline(cin, id);
 
             // Validate unique ID.
-            if (tree.search(id) != nullptr) {
+            if (shard->store.search(id)) {
                 cout << "Error: A task with this ID already exists.\n";
                 continue;
             }
@@ -92,173 +483,215 @@ int main() {
             cout << "Enter Category: ";
             getline(cin, category);
             
-            // Ask if the task is complete at insertion.
-            string status = "incomplete";
-            
-            // Ask for deadline details only if task is incomplete.
-            long totalRemainingHours = 0;
-            string deadlineStr = "N/A";
-            if (status == "incomplete") {
-                int years = getIntInput("Enter remaining years (0 if this year): ");
-                int months = getIntInput("Enter remaining months (0 if this month): ");
-                int days = getIntInput("Enter remaining days (0 if today): ");
-                int hours = 0;
-                if (years == 0 && months == 0 && days == 0) {
-                    hours = getIntInput("Enter remaining hours: ");
-                }
-                totalRemainingHours = static_cast<long>(years)*365*24 + static_cast<long>(months)*30*24 + static_cast<long>(days)*24 + hours;
-                deadlineStr = to_string(years) + " year(s), " + to_string(months) + " month(s), " +
-                              to_string(days) + " day(s)";
-                if (years == 0 && months == 0 && days == 0)
-                    deadlineStr += ", " + to_string(hours) + " hour(s)";
+            int years = getIntInput("Enter remaining years (0 if this year): ");
+            int months = getIntInput("Enter remaining months (0 if this month): ");
+            int days = getIntInput("Enter remaining days (0 if today): ");
+            int hours = 0;
+            if (years == 0 && months == 0 && days == 0) {
+                hours = getIntInput("Enter remaining hours: ");
             }
             
-            // Get current tasks (sorted by priority).
-            tasks = tree.listTasks();
-            int newPriority = 1;
-            if (status == "complete") {
-                if (!tasks.empty()) {
-                    newPriority = tasks.back().priority + 1;
-                }
-            } else {
-                if (!tasks.empty()) {
-                    if (totalRemainingHours < tasks.front().remainingHours) {
-                        newPriority = 1;
-                        for (auto &t : tasks) {
-                            t.priority++;
-                        }
-                    }
-                    else if (totalRemainingHours >= tasks.back().remainingHours) {
-                        newPriority = tasks.back().priority + 1;
-                    }
-                    else {
-                        for (auto &t : tasks) {
-                            if (totalRemainingHours < t.remainingHours) {
-                                newPriority = t.priority;
-                                break;
-                            }
-                        }
-                        for (auto &t : tasks) {
-                            if (t.priority >= newPriority) {
-                                t.priority++;
-                            }
-                        }
-                    }
-                }
-            }
-            
-            Task newTask(id, desc, newPriority, category, status, totalRemainingHours, deadlineStr);
-            tasks.push_back(newTask);
-            sort(tasks.begin(), tasks.end(), [](const Task &a, const Task &b) {
-                return a.priority < b.priority;
-            });
-            
-            tree.rebuild(tasks);
+            // The tree places the task by (status, remainingHours, sequence),
+            // so no other task is renumbered and only this task is queued for SQLite.
+            // A client of the server may have taken the ID meanwhile.
             try {
-                DBManager::rebuildTasks(tasks);
-            } catch (const runtime_error &e) {
-                cout << "Database error: " << e.what() << "\n";
+                int newPriority = shard->store.insert(Task::dueIn(id, desc, category, years, months, days, hours));
+                cout << "Task inserted successfully with priority " << newPriority << "!\n";
+            } catch (const runtime_error& e) {
+                cout << "Error: " << e.what() << "\n";
             }
-            cout << "Task inserted successfully with priority " << newPriority << "!\n";
         }
         else if (choice == 2) {
             // Update task status with repositioning.
             string id;
             cout << "Enter Task ID: ";
             getline(cin, id);
-            Task* taskPtr = tree.search(id);
-            if (!taskPtr) {
+            if (!shard->store.search(id)) {
                 cout << "Task not found.\n";
                 continue;
             }
             char completeAnswer = getYesNoInput("Do you want to mark as complete? (y/n): ");
-            string newStatus = (completeAnswer == 'y') ? "complete" : "incomplete";
-            
-            tasks = tree.listTasks();
-            bool found = false;
-            for (auto &t : tasks) {
-                if (t.id == id) {
-                    t.status = newStatus;
-                    found = true;
-                    break;
-                }
-            }
-            if (!found) {
-                cout << "Task not found in list.\n";
-                continue;
-            }
+            TaskStatus newStatus = (completeAnswer == 'y') ? TaskStatus::Complete : TaskStatus::Incomplete;
             
-            // Reorder tasks: separate incomplete and complete.
-            vector<Task> incompleteTasks, completeTasks;
-            for (auto &t : tasks) {
-                if (t.status == "incomplete")
-                    incompleteTasks.push_back(t);
-                else
-                    completeTasks.push_back(t);
-            }
-            sort(incompleteTasks.begin(), incompleteTasks.end(), [](const Task &a, const Task &b) {
-                return a.remainingHours < b.remainingHours;
-            });
-            sort(completeTasks.begin(), completeTasks.end(), [](const Task &a, const Task &b) {
-                return a.priority < b.priority;
-            });
-            
-            tasks.clear();
-            tasks.insert(tasks.end(), incompleteTasks.begin(), incompleteTasks.end());
-            tasks.insert(tasks.end(), completeTasks.begin(), completeTasks.end());
-            
-            int newPriority = 1;
-            for (auto &t : tasks) {
-                t.priority = newPriority++;
-            }
-            tree.rebuild(tasks);
+            // Reposition only this task; every other task keeps its place.
             try {
-                DBManager::rebuildTasks(tasks);
-            } catch (const runtime_error &e) {
-                cout << "Database error: " << e.what() << "\n";
+                int newPriority = shard->store.updateTaskStatus(id, newStatus);
+                cout << "Task status updated! New priority: " << newPriority << "\n";
+            } catch (const runtime_error& e) {
+                cout << e.what() << "\n";
             }
-            cout << "Task status updated and priorities re-assigned!\n";
         }
         else if (choice == 3) {
             string id;
             cout << "Enter Task ID to delete: ";
             getline(cin, id);
             try {
-                tree.deleteTask(id);
-                // Update database.
-                DBManager::deleteTask(id);
+                shard->store.deleteTask(id);
                 cout << "Task deleted.\n";
             } catch (const runtime_error& e) {
                 cout << e.what() << "\n";
             }
-            tasks = tree.listTasks();
         }
         else if (choice == 4) {
             string id;
             cout << "Enter Task ID to search: ";
             getline(cin, id);
-            Task* task = tree.search(id);
+            optional<Task> task = shard->store.search(id);
+            bool archived = false;
+            if (!task && shard->archiver()) {
+                task = shard->archiver()->find(id);
+                archived = task.has_value();
+            }
             if (task) {
-                cout << "Found Task:\n";
+                cout << (archived ? "Found Archived Task:\n" : "Found Task:\n");
                 cout << "ID: " << task->id << "\nDescription: " << task->description 
-                     << "\nDeadline: " << task->deadlineDetails << "\nPriority: " << task->priority 
-                     << "\nCategory: " << task->category << "\nStatus: " << task->status << "\n";
+                     << "\nDeadline: " << task->deadlineDetails() << "\nPriority: "
+                     << (archived ? string("archived") : to_string(task->priority)) 
+                     << "\nCategory: " << task->category() << "\nStatus: " << statusName(task->status) << "\n";
             } else {
                 cout << "Task not found.\n";
             }
         }
         else if (choice == 5) {
-            tasks = tree.listTasks();
-            cout << "\n----- TASK LIST -----\n";
-            for (const auto& t : tasks) {
-                cout << "Priority " << t.priority << " | ID: " << t.id << " | Desc: " << t.description 
-                     << " | Deadline: " << t.deadlineDetails << " | Status: " << t.status << "\n";
+            TaskWriter writer(cout, format);
+            writer.write("\n----- TASK LIST -----\n");
+            auto print = [&writer](const Task& t, int priority) { writer.write(t, priority); };
+            if (shard->store.hotSet()) {
+                // A page at a time, so the cold table is never held in memory
+                // at once; changes made meanwhile may shift tasks across pages.
+                const int pageSize = 10000;
+                for (int first = 1;; first += pageSize) {
+                    vector<Task> page = shard->store.range(first, first + pageSize - 1);
+                    for (const auto &t : page)
+                        print(t, t.priority);
+                    if (static_cast<int>(page.size()) < pageSize)
+                        break;
+                }
+            } else if (shared_ptr<const TaskSnapshot> snapshot = shard->store.snapshot()) {
+                // A consistent version, walked without holding the store's lock.
+                snapshot->forEach(print);
+            } else {
+                shard->store.read([&](const AVLTree &tree) { tree.forEach(print); });
             }
         }
         else if (choice == 6) {
+            if (server)
+                server->stop();
+            try {
+                shards.close();
+            } catch (const runtime_error &e) {
+                cout << "Database error: " << e.what() << "\n";
+            }
             cout << "Exiting Task Manager. Goodbye!\n";
             break;
         }
+        else if (choice == 7) {
+            // Answered from the secondary indexes, without scanning every task.
+            TaskQuery query;
+            string category;
+            cout << "Enter Category (leave blank for any): ";
+            getline(cin, category);
+            if (!category.empty())
+                query.category = category;
+            query.status = getStatusFilter("Status (i = incomplete, c = complete, a = any): ");
+            int withinHours = getIntInput("Due within how many hours? (-1 for any): ");
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            if (withinHours >= 0)
+                query.maxRemainingHours = withinHours;
+            vector<Task> matches = shard->store.query(query);
+            TaskWriter writer(cout, format);
+            writer.write("\n----- FILTERED TASKS -----\n");
+            for (const auto &t : matches)
+                writer.write(t, t.priority, TaskWriter::TEXT_CATEGORY | TaskWriter::TEXT_DEADLINE);
+            writer.write(to_string(matches.size()) + " task(s) found.\n");
+        }
+        else if (choice == 8) {
+            int count = getIntInput("How many tasks? ");
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            long long now = time(nullptr);
+            TaskWriter writer(cout, format);
+            writer.write("\n----- UPCOMING DEADLINES -----\n");
+            shard->store.read([&](const AVLTree &tree) {
+                return tree.forEachDue(LLONG_MIN, LLONG_MAX, [&](const Task& t) {
+                    writer.write(t, tree.rankOf(t.id), TaskWriter::TEXT_DUE_IN, now);
+                }, count > 0 ? static_cast<size_t>(count) : 0);
+            });
+        }
+        else if (choice == 9) {
+            cout << "\n----- STATISTICS -----\n";
+#if TASK_METRICS
+            cout << TaskMetrics::shared().summary();
+#else
+            cout << "Metrics were compiled out (built with -DTASK_METRICS=0).\n";
+#endif
+        }
+        else if (choice == 10) {
+            // Every word must start a word of the description or category.
+            string text;
+            cout << "Enter keywords: ";
+            getline(cin, text);
+            const size_t pageSize = 10;
+            for (size_t offset = 0;; offset += pageSize) {
+                size_t total = 0;
+                vector<Task> page = shard->store.searchText(text, offset, pageSize, total);
+                {
+                    TaskWriter writer(cout, format);
+                    if (offset == 0)
+                        writer.write("\n----- SEARCH RESULTS (" + to_string(total) + " match(es)) -----\n");
+                    for (const auto &t : page)
+                        writer.write(t, t.priority, TaskWriter::TEXT_CATEGORY);
+                }
+                // Only Text pages; the other formats are read by programs.
+                if (offset + page.size() >= total ||
+                    (format == OutputFormat::Text && getYesNoInput("Show more? (y/n): ") == 'n'))
+                    break;
+            }
+        }
+        else if (choice == 11) {
+            string name;
+            cout << "Enter Team (currently " << shard->team << "): ";
+            getline(cin, name);
+            try {
+                shard = &shards.shard(name);
+                startScheduler();
+                cout << "Switched to team " << shard->team << " (" << shard->store.size() << " task(s)).\n";
+            } catch (const runtime_error &e) {
+                cout << e.what() << "\n";
+            }
+        }
+        else if (choice == 12) {
+            TaskArchiver *archiver = shard->archiver();
+            if (!archiver) {
+                cout << "Archiving is off; start with --archive-after <days>.\n";
+                continue;
+            }
+            const int pageSize = 10;
+            int total = archiver->size();
+            for (int offset = 0; offset < total; offset += pageSize) {
+                {
+                    TaskWriter writer(cout, format);
+                    if (offset == 0)
+                        writer.write("\n----- ARCHIVED TASKS (" + to_string(total) + ") -----\n");
+                    for (const auto &t : archiver->list(offset, pageSize))
+                        writer.write(t, TaskWriter::NO_PRIORITY, TaskWriter::TEXT_CATEGORY | TaskWriter::TEXT_DEADLINE);
+                }
+                if (offset + pageSize >= total ||
+                    (format == OutputFormat::Text && getYesNoInput("Show more? (y/n): ") == 'n'))
+                    break;
+            }
+        }
+        else if (choice == 13) {
+            if (!shard->store.snapshot()) {
+                cout << "Undo is off; start with --undo <steps>.\n";
+                continue;
+            }
+            int steps = getIntInput("How many changes to undo? ");
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            if (steps <= 0)
+                continue;
+            size_t undone = shard->store.undo(static_cast<size_t>(steps));
+            cout << "Undid " << undone << " change(s).\n";
+        }
         else {
             cout << "Invalid choice. Try again.\n";
         }
@@ -0,0 +1,445 @@
+#ifndef PERSISTENT_TASK_TREE_H
+#define PERSISTENT_TASK_TREE_H
+
+#include "SmartTaskManager.h"
+#include <memory>
+
+// Immutable AVL map with path copying: inserted()/erased() return a new map
+// that shares every untouched subtree with the old one, so each update costs
+// O(log n) new nodes and old versions stay valid for as long as they are
+// held. Nodes carry subtree sizes for O(log n) ranks, like AVLTree.
+template <typename K, typename V>
+class PersistentMap {
+private:
+    struct Node;
+    typedef shared_ptr<const Node> Ptr;
+
+    struct Node {
+        K key;
+        V value;
+        Ptr left;
+        Ptr right;
+        int height;
+        int size;
+
+        Node(K k, V v, Ptr l, Ptr r)
+            : key(std::move(k)), value(std::move(v)), left(std::move(l)), right(std::move(r)),
+              height(1 + max(getHeight(left), getHeight(right))), size(1 + getSize(left) + getSize(right)) {}
+    };
+
+    Ptr root;
+
+    explicit PersistentMap(Ptr r) : root(std::move(r)) {}
+
+    static int getHeight(const Ptr& node) { return node ? node->height : 0; }
+    static int getSize(const Ptr& node) { return node ? node->size : 0; }
+
+    static Ptr make(const K& key, const V& value, Ptr left, Ptr right) {
+        return make_shared<const Node>(key, value, std::move(left), std::move(right));
+    }
+
+    // Builds a node from its parts, rotating (with fresh nodes) if the two
+    // sides differ in height by more than one.
+    static Ptr balance(const K& key, const V& value, Ptr left, Ptr right) {
+        int balanceFactor = getHeight(left) - getHeight(right);
+        if (balanceFactor > 1) {
+            if (getHeight(left->left) < getHeight(left->right)) {
+                const Ptr& pivot = left->right;
+                return make(pivot->key, pivot->value, make(left->key, left->value, left->left, pivot->left),
+                            make(key, value, pivot->right, std::move(right)));
+            }
+            return make(left->key, left->value, left->left, make(key, value, left->right, std::move(right)));
+        }
+        if (balanceFactor < -1) {
+            if (getHeight(right->right) < getHeight(right->left)) {
+                const Ptr& pivot = right->left;
+                return make(pivot->key, pivot->value, make(key, value, std::move(left), pivot->left),
+                            make(right->key, right->value, pivot->right, right->right));
+            }
+            return make(right->key, right->value, make(key, value, std::move(left), right->left), right->right);
+        }
+        return make(key, value, std::move(left), std::move(right));
+    }
+
+    // Inserts or replaces key.
+    static Ptr insert(const Ptr& node, const K& key, const V& value) {
+        if (!node)
+            return make(key, value, nullptr, nullptr);
+        if (key < node->key)
+            return balance(node->key, node->value, insert(node->left, key, value), node->right);
+        if (node->key < key)
+            return balance(node->key, node->value, node->left, insert(node->right, key, value));
+        return make(key, value, node->left, node->right);
+    }
+
+    // Balanced tree over items[first..last], which are sorted by key.
+    static Ptr build(vector<pair<K, V>>& items, int first, int last) {
+        if (first > last)
+            return nullptr;
+        int middle = first + (last - first) / 2;
+        Ptr left = build(items, first, middle - 1);
+        Ptr right = build(items, middle + 1, last);
+        return make_shared<const Node>(std::move(items[middle].first), std::move(items[middle].second), std::move(left),
+                                       std::move(right));
+    }
+
+    static const Node* findMin(const Ptr& node) {
+        const Node* current = node.get();
+        while (current->left)
+            current = current->left.get();
+        return current;
+    }
+
+    static Ptr eraseMin(const Ptr& node) {
+        if (!node->left)
+            return node->right;
+        return balance(node->key, node->value, eraseMin(node->left), node->right);
+    }
+
+    // Returns node unchanged (same pointer) when key is absent.
+    static Ptr erase(const Ptr& node, const K& key) {
+        if (!node)
+            return nullptr;
+        if (key < node->key) {
+            Ptr left = erase(node->left, key);
+            return left == node->left ? node : balance(node->key, node->value, std::move(left), node->right);
+        }
+        if (node->key < key) {
+            Ptr right = erase(node->right, key);
+            return right == node->right ? node : balance(node->key, node->value, node->left, std::move(right));
+        }
+        if (!node->left)
+            return node->right;
+        if (!node->right)
+            return node->left;
+        const Node* successor = findMin(node->right);
+        return balance(successor->key, successor->value, node->left, eraseMin(node->right));
+    }
+
+public:
+    PersistentMap() {}
+
+    // Builds a map in O(n) from items sorted by strictly increasing key.
+    static PersistentMap fromSorted(vector<pair<K, V>> items) {
+        return PersistentMap(build(items, 0, static_cast<int>(items.size()) - 1));
+    }
+
+    int size() const { return getSize(root); }
+
+    PersistentMap inserted(const K& key, const V& value) const { return PersistentMap(insert(root, key, value)); }
+
+    PersistentMap erased(const K& key) const { return PersistentMap(erase(root, key)); }
+
+    const V* find(const K& key) const {
+        const Node* node = root.get();
+        while (node) {
+            if (key < node->key)
+                node = node->left.get();
+            else if (node->key < key)
+                node = node->right.get();
+            else
+                return &node->value;
+        }
+        return nullptr;
+    }
+
+    // 1-based position of key, or 0 if absent.
+    int rankOf(const K& key) const {
+        int rank = 0;
+        const Node* node = root.get();
+        while (node) {
+            if (key < node->key) {
+                node = node->left.get();
+            } else if (node->key < key) {
+                rank += getSize(node->left) + 1;
+                node = node->right.get();
+            } else {
+                return rank + getSize(node->left) + 1;
+            }
+        }
+        return 0;
+    }
+
+    // Value at position k (1-based), or nullptr if out of range.
+    const V* select(int k) const {
+        if (k < 1 || k > size())
+            return nullptr;
+        const Node* node = root.get();
+        while (true) {
+            int leftSize = getSize(node->left);
+            if (k <= leftSize) {
+                node = node->left.get();
+            } else if (k == leftSize + 1) {
+                return &node->value;
+            } else {
+                k -= leftSize + 1;
+                node = node->right.get();
+            }
+        }
+    }
+
+    // Calls visitor(key, value, position) for positions first..last in order.
+    template <typename Visitor>
+    void forRange(int first, int last, Visitor visitor) const {
+        visitRange(root.get(), 0, max(first, 1), min(last, size()), visitor);
+    }
+
+private:
+    template <typename Visitor>
+    static void visitRange(const Node* node, int offset, int first, int last, Visitor& visitor) {
+        if (!node || first > last) return;
+        int rank = offset + getSize(node->left) + 1;
+        if (first < rank)
+            visitRange(node->left.get(), offset, first, last, visitor);
+        if (first <= rank && rank <= last)
+            visitor(node->key, node->value, rank);
+        if (last > rank)
+            visitRange(node->right.get(), rank, first, last, visitor);
+    }
+};
+
+// One immutable version of the task set. Holding the shared_ptr keeps the
+// version (and every Task* taken from it) valid while writers move on.
+class TaskSnapshot {
+private:
+    friend class VersionedTaskTree;
+
+    PersistentMap<OrderKey, shared_ptr<const Task>> byKey; // priority order
+    PersistentMap<string, OrderKey> byId;
+    vector<string> changedIds; // tasks touched by the write that made this version
+
+public:
+    int size() const { return byKey.size(); }
+
+    const Task* search(const string& id) const {
+        const OrderKey* key = byId.find(id);
+        return key ? byKey.find(*key)->get() : nullptr;
+    }
+
+    // 1-based priority, or 0 if the ID is not in this version.
+    int rankOf(const string& id) const {
+        const OrderKey* key = byId.find(id);
+        return key ? byKey.rankOf(*key) : 0;
+    }
+
+    // Calls visitor(task, priority) for priorities first..last.
+    template <typename Visitor>
+    void forRange(int first, int last, Visitor visitor) const {
+        byKey.forRange(first, last, [&](const OrderKey&, const shared_ptr<const Task>& task, int rank) {
+            visitor(*task, rank);
+        });
+    }
+
+    template <typename Visitor>
+    void forEach(Visitor visitor) const {
+        forRange(1, size(), visitor);
+    }
+
+    // Copies tasks first..last with priority filled in.
+    vector<Task> range(int first, int last) const {
+        vector<Task> tasks;
+        forRange(first, last, [&](const Task& task, int rank) {
+            tasks.push_back(task);
+            tasks.back().priority = rank;
+        });
+        return tasks;
+    }
+};
+
+// Versioned mirror of an AVLTree, attached as its journal (see
+// TaskStore::enableSnapshots): every change the tree records publishes a new
+// TaskSnapshot in O(log n), sharing untouched subtrees and tasks with the
+// versions before it, and is passed on to the downstream journal. Changes
+// between beginBatch and commitBatch make one version, so a write that
+// touches many tasks (e.g. AVLTree::recomputeDeadlines) is one undo step.
+// Readers take a consistent snapshot without locking the tree, and the last
+// maxUndo versions are kept for undo(). Tasks are keyed under the tree's
+// TaskOrder, so snapshots list them in the tree's priority order.
+// recordUpsert, recordDelete and the batch calls must not run concurrently,
+// as for any journal; snapshot() may be called from any thread.
+class VersionedTaskTree : public TaskJournal {
+private:
+    mutable mutex publishLock; // guards current and history
+    shared_ptr<const TaskSnapshot> current;
+    deque<shared_ptr<const TaskSnapshot>> history; // oldest first
+    size_t maxUndo;
+    TaskOrder order;
+    TaskJournal* downstream;
+    bool replaying; // undo() is putting the tree back: forward only
+    bool batching;
+    shared_ptr<TaskSnapshot> pending; // the open batch's version, once it has a change
+
+    void publish(shared_ptr<const TaskSnapshot> next) {
+        lock_guard<mutex> guard(publishLock);
+        history.push_back(current);
+        if (history.size() > maxUndo)
+            history.pop_front();
+        current = std::move(next);
+    }
+
+    shared_ptr<const TaskSnapshot> latest() const {
+        lock_guard<mutex> guard(publishLock);
+        return current;
+    }
+
+    // The version a change goes into: the open batch's, or a new one. A new
+    // one shares the maps of the latest version (O(1)) and starts with no
+    // changed IDs, however many the latest one lists.
+    shared_ptr<TaskSnapshot> draft() {
+        if (batching && pending)
+            return pending;
+        shared_ptr<const TaskSnapshot> base = latest();
+        auto next = make_shared<TaskSnapshot>();
+        next->byKey = base->byKey;
+        next->byId = base->byId;
+        if (batching)
+            pending = next;
+        return next;
+    }
+
+    void changed(shared_ptr<TaskSnapshot> next, const string& id) {
+        next->changedIds.push_back(id);
+        if (!batching)
+            publish(std::move(next));
+    }
+
+public:
+    explicit VersionedTaskTree(size_t maxUndoSteps = 100, TaskJournal* next = nullptr)
+        : current(make_shared<TaskSnapshot>()), maxUndo(maxUndoSteps), downstream(next), replaying(false),
+          batching(false) {}
+
+    VersionedTaskTree(const VersionedTaskTree&) = delete;
+    VersionedTaskTree& operator=(const VersionedTaskTree&) = delete;
+
+    void setDownstream(TaskJournal* next) { downstream = next; }
+
+    // Starts over from tasks, keyed under o, with no history. O(n log n)
+    // for the ID map; the priority map is built bottom-up.
+    void reset(const vector<Task>& tasks, const TaskOrder& o) {
+        order = o;
+        vector<pair<OrderKey, shared_ptr<const Task>>> byKey;
+        vector<pair<string, OrderKey>> byId;
+        byKey.reserve(tasks.size());
+        byId.reserve(tasks.size());
+        for (const auto &task : tasks) {
+            OrderKey key = order.keyOf(task);
+            byKey.emplace_back(key, make_shared<const Task>(task));
+            byId.emplace_back(task.id, key);
+        }
+        sort(byKey.begin(), byKey.end(),
+             [](const pair<OrderKey, shared_ptr<const Task>>& a, const pair<OrderKey, shared_ptr<const Task>>& b) {
+                 return a.first < b.first;
+             });
+        sort(byId.begin(), byId.end(),
+             [](const pair<string, OrderKey>& a, const pair<string, OrderKey>& b) { return a.first < b.first; });
+        auto next = make_shared<TaskSnapshot>();
+        next->byKey = PersistentMap<OrderKey, shared_ptr<const Task>>::fromSorted(std::move(byKey));
+        next->byId = PersistentMap<string, OrderKey>::fromSorted(std::move(byId));
+        lock_guard<mutex> guard(publishLock);
+        history.clear();
+        current = std::move(next);
+    }
+
+    shared_ptr<const TaskSnapshot> snapshot() const { return latest(); }
+
+    // Collects the changes recorded until commitBatch into one version;
+    // snapshot() keeps returning the version before them until then.
+    void beginBatch() { batching = true; }
+
+    // Publishes the batch's version, if it changed anything.
+    void commitBatch() {
+        batching = false;
+        if (pending)
+            publish(std::move(pending));
+        pending.reset();
+    }
+
+    void recordUpsert(const Task& task) override {
+        if (!replaying) {
+            shared_ptr<TaskSnapshot> next = draft();
+            const OrderKey* old = next->byId.find(task.id);
+            if (old)
+                next->byKey = next->byKey.erased(*old);
+            OrderKey key = order.keyOf(task);
+            next->byId = next->byId.inserted(task.id, key);
+            next->byKey = next->byKey.inserted(key, make_shared<const Task>(task));
+            changed(std::move(next), task.id);
+        }
+        if (downstream)
+            downstream->recordUpsert(task);
+    }
+
+    void recordDelete(const string& id) override {
+        if (!replaying) {
+            shared_ptr<const TaskSnapshot> base = pending ? pending : latest();
+            if (const OrderKey* key = base->byId.find(id)) {
+                shared_ptr<TaskSnapshot> next = draft();
+                next->byKey = base->byKey.erased(*key);
+                next->byId = base->byId.erased(id);
+                changed(std::move(next), id);
+            }
+        }
+        if (downstream)
+            downstream->recordDelete(id);
+    }
+
+    size_t undoDepth() const {
+        lock_guard<mutex> guard(publishLock);
+        return history.size();
+    }
+
+    // Steps back steps versions (fewer if less history is kept) and calls
+    // restore(id, task) for each task changed since, with its state in the
+    // version returned to (nullptr if it did not exist). restore puts the
+    // tree back; what it journals is passed downstream but not versioned.
+    // The versions are dropped only once every restore has succeeded. If
+    // one throws, the tasks already restored are put back to the current
+    // version (best effort) and history is kept, so undo can be retried.
+    // Returns how many versions were undone. O(steps), no copying.
+    template <typename Restore>
+    size_t undo(size_t steps, Restore restore) {
+        vector<string> changed;
+        shared_ptr<const TaskSnapshot> from;
+        shared_ptr<const TaskSnapshot> target;
+        {
+            lock_guard<mutex> guard(publishLock);
+            steps = min(steps, history.size());
+            if (steps == 0)
+                return 0;
+            changed = current->changedIds;
+            for (size_t i = 1; i < steps; i++) {
+                const vector<string>& ids = history[history.size() - i]->changedIds;
+                changed.insert(changed.end(), ids.begin(), ids.end());
+            }
+            from = current;
+            target = history[history.size() - steps];
+        }
+        sort(changed.begin(), changed.end());
+        changed.erase(unique(changed.begin(), changed.end()), changed.end());
+        replaying = true;
+        size_t restored = 0;
+        try {
+            for (; restored < changed.size(); restored++)
+                restore(changed[restored], target->search(changed[restored]));
+        } catch (...) {
+            // Including the task whose restore failed part way.
+            for (size_t i = 0; i <= restored && i < changed.size(); i++) {
+                try {
+                    restore(changed[i], from->search(changed[i]));
+                } catch (...) {
+                }
+            }
+            replaying = false;
+            throw;
+        }
+        replaying = false;
+        // Writers are excluded while undo runs (see TaskStore), so no
+        // version was published meanwhile.
+        lock_guard<mutex> guard(publishLock);
+        history.resize(history.size() - steps);
+        current = target;
+        return steps;
+    }
+};
+
+#endif
@@ -2,303 +2,2164 @@
 #define SMART_TASK_MANAGER_H
 
 #include <iostream>
+#include <iterator>
+#include <cstddef>
 #include <algorithm>
 #include <string>
 #include <stdexcept>
 #include <unordered_map>
 #include <vector>
+#include <deque>
+#include <map>
+#include <climits>
+#include <ctime>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <charconv>
+#include <optional>
+#include <string_view>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
 #include <sqlite3.h>
+#include "TaskMetrics.h"
 
 using namespace std;
 
+enum class TaskStatus : uint8_t { Incomplete, Complete };
+
+inline const char* statusName(TaskStatus status) {
+    return status == TaskStatus::Complete ? "complete" : "incomplete";
+}
+
+inline TaskStatus parseStatus(const string& name) {
+    return name == "complete" ? TaskStatus::Complete : TaskStatus::Incomplete;
+}
+
+// Interns category names so each Task stores a 4-byte ID. Shared by all tasks;
+// names are never removed, and references to them stay valid. intern and
+// find lock; name, called for every task written, listed or searched, does
+// not. Names live in blocks that never move (block k holds 64 << k), and
+// count is raised only once a name is in place, so a reader holding an ID
+// can always index its block.
+class CategoryDictionary {
+private:
+    static const int FIRST_BLOCK_BITS = 6;
+    static const int BLOCKS = 32 - FIRST_BLOCK_BITS + 1; // enough for every uint32_t ID
+
+    mutex lock; // guards ids and appending
+    atomic<string*> blocks[BLOCKS];
+    atomic<uint32_t> count;
+    unordered_map<string, uint32_t> ids;
+
+    // Block and index within it: IDs 0-63 are in block 0, 64-191 in block 1, ...
+    static pair<int, size_t> locate(uint32_t id) {
+        uint64_t position = static_cast<uint64_t>(id) + (uint64_t(1) << FIRST_BLOCK_BITS);
+        int bit = 63 - __builtin_clzll(position);
+        return make_pair(bit - FIRST_BLOCK_BITS, static_cast<size_t>(position - (uint64_t(1) << bit)));
+    }
+
+public:
+    CategoryDictionary() : count(0) {
+        for (auto &block : blocks)
+            block.store(nullptr, memory_order_relaxed);
+    }
+
+    ~CategoryDictionary() {
+        for (auto &block : blocks)
+            delete[] block.load(memory_order_relaxed);
+    }
+
+    CategoryDictionary(const CategoryDictionary&) = delete;
+    CategoryDictionary& operator=(const CategoryDictionary&) = delete;
+
+    static CategoryDictionary& shared() {
+        static CategoryDictionary dictionary;
+        return dictionary;
+    }
+
+    uint32_t intern(const string& name) {
+        lock_guard<mutex> guard(lock);
+        auto it = ids.find(name);
+        if (it != ids.end())
+            return it->second;
+        uint32_t id = count.load(memory_order_relaxed);
+        pair<int, size_t> slot = locate(id);
+        string* block = blocks[slot.first].load(memory_order_relaxed);
+        if (!block) {
+            block = new string[size_t(1) << (slot.first + FIRST_BLOCK_BITS)];
+            blocks[slot.first].store(block, memory_order_release);
+        }
+        block[slot.second] = name;
+        ids.emplace(name, id);
+        count.store(id + 1, memory_order_release);
+        return id;
+    }
+
+    // ID of an existing category, without interning a new one.
+    optional<uint32_t> find(const string& name) {
+        lock_guard<mutex> guard(lock);
+        auto it = ids.find(name);
+        if (it == ids.end())
+            return nullopt;
+        return it->second;
+    }
+
+    const string& name(uint32_t id) const {
+        if (id >= count.load(memory_order_acquire))
+            throw out_of_range("Unknown category ID " + to_string(id));
+        pair<int, size_t> slot = locate(id);
+        return blocks[slot.first].load(memory_order_acquire)[slot.second];
+    }
+};
+
+// The years/months/days the user entered for a deadline. remainingHours holds
+// the resulting number; this only keeps enough to print it back as typed.
+struct DeadlineSpan {
+    int years;
+    int months;
+    int days;
+
+    static long hoursIn(int years, int months, int days) {
+        return static_cast<long>(years)*365*24 + static_cast<long>(months)*30*24 + static_cast<long>(days)*24;
+    }
+
+    // Splits a stored hour count when the original input is not available.
+    static DeadlineSpan fromHours(long hours) {
+        DeadlineSpan span;
+        span.years = static_cast<int>(hours / (365 * 24));
+        hours -= static_cast<long>(span.years) * 365 * 24;
+        span.months = static_cast<int>(hours / (30 * 24));
+        hours -= static_cast<long>(span.months) * 30 * 24;
+        span.days = static_cast<int>(hours / 24);
+        return span;
+    }
+
+    // Parses the deadlineDetails text written by format(), falling back to
+    // fromHours for anything else.
+    static DeadlineSpan parse(const string& text, long remainingHours) {
+        static const char* const units[] = {" year(s), ", " month(s), ", " day(s)"};
+        int values[3];
+        const char* cursor = text.c_str();
+        for (int i = 0; i < 3; i++) {
+            char* end;
+            long value = strtol(cursor, &end, 10);
+            size_t unitLength = strlen(units[i]);
+            if (end == cursor || strncmp(end, units[i], unitLength) != 0)
+                return fromHours(remainingHours);
+            values[i] = static_cast<int>(value);
+            cursor = end + unitLength;
+        }
+        return DeadlineSpan{values[0], values[1], values[2]};
+    }
+
+    string format(long remainingHours) const {
+        string text;
+        appendTo(text, remainingHours);
+        return text;
+    }
+
+    // format() appended to text, without temporaries (see TaskWriter).
+    void appendTo(string& text, long remainingHours) const {
+        char digits[24];
+        auto number = [&](long value, const char* unit) {
+            text.append(digits, to_chars(digits, digits + sizeof(digits), value).ptr);
+            text += unit;
+        };
+        number(years, " year(s), ");
+        number(months, " month(s), ");
+        number(days, " day(s)");
+        if (years == 0 && months == 0 && days == 0) {
+            text += ", ";
+            number(remainingHours, " hour(s)");
+        }
+    }
+};
+
+// Compact task record: status is an enum, category an interned ID and the
+// deadline text is formatted on demand, leaving only id and description as
+// strings (short ones stay inline).
 class Task {
 public:
     string id;
     string description;
-    string deadlineDetails; // A string representation of the deadline input (for display)
-    int priority;
-    string category;
-    string status;
     long remainingHours; // computed remaining time in hours
+    long long sequence; // insertion sequence, breaks ties between equal deadlines
+    long long dueAt; // absolute due time (Unix seconds), fixed when the task is created
+    DeadlineSpan deadline;
+    int priority; // position in the ordering, derived from the tree (not stored per node)
+    uint32_t categoryId; // index into CategoryDictionary::shared()
+    TaskStatus status;
+
+    Task(string i, string d, const string& category, TaskStatus s, long rH, DeadlineSpan dl, long long seq = 0,
+         long long due = 0)
+        : id(std::move(i)), description(std::move(d)), remainingHours(rH), sequence(seq), dueAt(due), deadline(dl), priority(0),
+          categoryId(CategoryDictionary::shared().intern(category)), status(s) {}
 
-    // Constructor with remainingHours and deadlineDetails.
-    Task(string i, string d, int p, string c, string s, long rH, string dlDetails)
-        : id(i), description(d), priority(p), category(c), status(s), remainingHours(rH), deadlineDetails(dlDetails) {}
+    // New incomplete task due the given time from now.
+    static Task dueIn(string id, string desc, const string& category, int years, int months, int days, int hours,
+                      long long seq = 0) {
+        long totalRemainingHours = DeadlineSpan::hoursIn(years, months, days) + hours;
+        long long due = time(nullptr) + totalRemainingHours * 3600LL;
+        return Task(std::move(id), std::move(desc), category, TaskStatus::Incomplete, totalRemainingHours,
+                    DeadlineSpan{years, months, days}, seq, due);
+    }
+
+    bool isComplete() const { return status == TaskStatus::Complete; }
+
+    const string& category() const { return CategoryDictionary::shared().name(categoryId); }
+
+    // A string representation of the deadline input (for display)
+    string deadlineDetails() const { return deadline.format(remainingHours); }
+};
+
+// Ordering key of the priority tree: incomplete before complete, then ascending
+// remainingHours, then insertion sequence. Inserting a task never changes the
+// key of any other task, so no renumbering is needed.
+struct OrderKey {
+    int statusRank;
+    long primary; // remainingHours under the default TaskOrder
+    long long sequence;
+
+    // Key under the default order (TaskOrder::ByRemainingHours).
+    static OrderKey of(const Task& task) {
+        return OrderKey{task.isComplete() ? 1 : 0, task.remainingHours, task.sequence};
+    }
+
+    bool operator<(const OrderKey& other) const {
+        if (statusRank != other.statusRank) return statusRank < other.statusRank;
+        if (primary != other.primary) return primary < other.primary;
+        return sequence < other.sequence;
+    }
+};
+
+// Ordering policy of an AVLTree: what OrderKey::primary holds. Incomplete
+// tasks always come first and sequence always breaks ties, so every policy
+// keeps the status split the rest of the code relies on. Comparisons only
+// ever see the key cached in each node; the policy runs once per insert or
+// status change, when a task's key is computed.
+//   deadline              remaining hours (the original order)
+//   due                   absolute due time, so recomputeDeadlines never moves a task
+//   category:<c>=<w>,...  category weight, heaviest first (unlisted: 0), then remaining hours
+struct TaskOrder {
+    enum Policy { ByRemainingHours, ByDueTime, ByCategoryWeight };
+
+    Policy policy = ByRemainingHours;
+    unordered_map<uint32_t, int> categoryWeights; // ByCategoryWeight, by category ID
+
+    static const int MAX_WEIGHT = 1 << 20;
+
+    OrderKey keyOf(const Task& task) const {
+        int status = task.isComplete() ? 1 : 0;
+        switch (policy) {
+        case ByDueTime:
+            return OrderKey{status, static_cast<long>(task.dueAt), task.sequence};
+        case ByCategoryWeight: {
+            auto it = categoryWeights.find(task.categoryId);
+            long weight = it == categoryWeights.end() ? 0 : it->second;
+            const long HOURS_LIMIT = 1L << 39;
+            long hours = max(-HOURS_LIMIT, min(task.remainingHours, HOURS_LIMIT - 1));
+            return OrderKey{status, -weight * (HOURS_LIMIT << 1) + hours, task.sequence};
+        }
+        default:
+            return OrderKey{status, task.remainingHours, task.sequence};
+        }
+    }
+
+    // Spelled as in the table above; throws on anything else.
+    static TaskOrder parse(const string& spec) {
+        TaskOrder order;
+        if (spec == "deadline")
+            return order;
+        if (spec == "due") {
+            order.policy = ByDueTime;
+            return order;
+        }
+        const string prefix = "category:";
+        if (spec.compare(0, prefix.size(), prefix) != 0)
+            throw runtime_error("Unknown task order: " + spec);
+        order.policy = ByCategoryWeight;
+        for (size_t start = prefix.size(); start <= spec.size();) {
+            size_t comma = min(spec.find(',', start), spec.size());
+            string entry = spec.substr(start, comma - start);
+            start = comma + 1;
+            size_t equals = entry.rfind('=');
+            size_t used = 0;
+            int weight = 0;
+            try {
+                if (equals != string::npos && equals > 0)
+                    weight = stoi(entry.substr(equals + 1), &used);
+            } catch (const exception &) {
+                used = 0;
+            }
+            if (used == 0 || equals + 1 + used != entry.size() || abs(weight) >= MAX_WEIGHT)
+                throw runtime_error("Invalid category weight: " + entry);
+            order.categoryWeights[CategoryDictionary::shared().intern(entry.substr(0, equals))] = weight;
+        }
+        return order;
+    }
+};
+
+// Filter for AVLTree::query. Unset fields match everything; the deadline
+// bounds are inclusive.
+struct TaskQuery {
+    optional<string> category;
+    optional<TaskStatus> status;
+    long minRemainingHours = LONG_MIN;
+    long maxRemainingHours = LONG_MAX;
+};
+
+// Receives the tasks touched by AVLTree mutations so they can be persisted
+// later instead of on the caller's thread.
+class TaskJournal {
+public:
+    virtual ~TaskJournal() {}
+    virtual void recordUpsert(const Task& task) = 0;
+    virtual void recordDelete(const string& id) = 0;
+};
+
+// Latest state per task ID; nullopt is a tombstone. Written by
+// DBManager::writeChanges in one transaction.
+typedef unordered_map<string, optional<Task>> ChangeSet;
+
+// Journal that just accumulates a ChangeSet, for callers that decide
+// themselves when to write it (e.g. batch mode).
+class ChangeRecorder : public TaskJournal {
+public:
+    ChangeSet changes;
+
+    void recordUpsert(const Task& task) override {
+        changes.insert_or_assign(task.id, task);
+    }
+
+    void recordDelete(const string& id) override {
+        changes.insert_or_assign(id, nullopt);
+    }
+};
+
+// Inverted index from the words of each task's description and category to
+// the tree nodes holding them, for keyword search with prefix matching.
+// Words are lower-cased runs of letters and digits; bytes >= 0x80 count as
+// letters, so UTF-8 words stay whole. Each posting list is a sorted vector
+// of node indexes. Updates find their lists by hash; an ordered view of the
+// same words makes every word with a given prefix one range.
+class TextIndex {
+private:
+    unordered_map<string, vector<int>> postings;
+    map<string_view, const vector<int>*> ordered; // views of the postings keys
+
+    static bool isWordByte(unsigned char c) { return isalnum(c) || c >= 0x80; }
+    static char fold(unsigned char c) { return static_cast<char>(tolower(c)); }
+
+    static vector<string> taskWords(const Task& task) {
+        vector<string> all = words(task.description);
+        vector<string> category = words(task.category());
+        all.insert(all.end(), category.begin(), category.end());
+        sort(all.begin(), all.end());
+        all.erase(unique(all.begin(), all.end()), all.end());
+        return all;
+    }
+
+    // Number of postings under prefix, counting no further than cap.
+    size_t countWithPrefix(const string& prefix, size_t cap) const {
+        size_t total = 0;
+        for (auto it = ordered.lower_bound(prefix);
+             it != ordered.end() && it->first.compare(0, prefix.size(), prefix) == 0 && total <= cap; ++it)
+            total += it->second->size();
+        return total;
+    }
+
+public:
+    static vector<string> words(const string& text) {
+        vector<string> result;
+        string word;
+        for (unsigned char c : text) {
+            if (isWordByte(c)) {
+                word += fold(c);
+            } else if (!word.empty()) {
+                result.push_back(std::move(word));
+                word.clear();
+            }
+        }
+        if (!word.empty())
+            result.push_back(std::move(word));
+        return result;
+    }
+
+    // True if text has a word starting with prefix (already lower-cased);
+    // exact is set if one such word is the whole prefix. Does not allocate.
+    static bool matches(const string& text, const string& prefix, bool& exact) {
+        bool found = false;
+        size_t i = 0, n = text.size();
+        while (i < n) {
+            while (i < n && !isWordByte(text[i]))
+                i++;
+            size_t start = i;
+            while (i < n && isWordByte(text[i]))
+                i++;
+            size_t length = i - start;
+            if (length < prefix.size() || length == 0)
+                continue;
+            size_t k = 0;
+            while (k < prefix.size() && fold(text[start + k]) == prefix[k])
+                k++;
+            if (k == prefix.size()) {
+                found = true;
+                if (length == prefix.size()) {
+                    exact = true;
+                    return true;
+                }
+            }
+        }
+        return found;
+    }
+
+    // Nodes are appended cheaply when added in increasing index order, as
+    // AVLTree::rebuild does.
+    void add(const Task& task, int node) {
+        for (auto &word : taskWords(task)) {
+            auto entry = postings.find(word);
+            if (entry == postings.end()) {
+                entry = postings.emplace(std::move(word), vector<int>()).first;
+                ordered.emplace(entry->first, &entry->second);
+            }
+            vector<int>& list = entry->second;
+            auto position = lower_bound(list.begin(), list.end(), node);
+            if (position == list.end() || *position != node)
+                list.insert(position, node);
+        }
+    }
+
+    void remove(const Task& task, int node) {
+        for (const auto &word : taskWords(task)) {
+            auto entry = postings.find(word);
+            if (entry == postings.end())
+                continue;
+            vector<int>& list = entry->second;
+            auto position = lower_bound(list.begin(), list.end(), node);
+            if (position != list.end() && *position == node)
+                list.erase(position);
+            if (list.empty()) {
+                ordered.erase(entry->first);
+                postings.erase(entry);
+            }
+        }
+    }
+
+    void clear() {
+        ordered.clear();
+        postings.clear();
+    }
+
+    TextIndex() {}
+    TextIndex(const TextIndex&) = delete; // ordered points into postings
+    TextIndex& operator=(const TextIndex&) = delete;
+
+    // Sorted nodes having a word that starts with one of the prefixes: the
+    // one with the fewest postings, so callers only check the rest against
+    // a short candidate list. Sets chosen to that prefix's position and
+    // exact to the nodes having it as a whole word (nullptr for none).
+    vector<int> candidates(const vector<string>& prefixes, size_t& chosen, const vector<int>*& exact) const {
+        size_t bestCount = SIZE_MAX;
+        chosen = 0;
+        for (size_t i = 0; i < prefixes.size(); i++) {
+            size_t count = countWithPrefix(prefixes[i], bestCount);
+            if (count < bestCount) {
+                chosen = i;
+                bestCount = count;
+            }
+        }
+        vector<int> nodes;
+        exact = nullptr;
+        if (prefixes.empty() || bestCount == 0)
+            return nodes;
+        const string& best = prefixes[chosen];
+        nodes.reserve(bestCount);
+        size_t terms = 0;
+        for (auto it = ordered.lower_bound(best); it != ordered.end() && it->first.compare(0, best.size(), best) == 0;
+             ++it, ++terms) {
+            if (it->first.size() == best.size())
+                exact = it->second;
+            nodes.insert(nodes.end(), it->second->begin(), it->second->end());
+        }
+        if (terms > 1) {
+            sort(nodes.begin(), nodes.end());
+            nodes.erase(unique(nodes.begin(), nodes.end()), nodes.end());
+        }
+        return nodes;
+    }
 };
 
 class AVLTree {
 private:
+    // Nodes live in a pool and link to each other by index (NIL for none).
+    typedef int NodeIndex;
+    static const NodeIndex NIL = -1;
+    static const int SLAB_BITS = 12;
+    static const int SLAB_SIZE = 1 << SLAB_BITS; // nodes per slab
+
     struct Node {
         Task task;
-        int key; // key is task.priority (uniqueness is maintained by shifting priorities)
-        Node* left;
-        Node* right;
+        OrderKey key; // unique because sequence is unique
+        NodeIndex left;
+        NodeIndex right;
         int height;
+        int size; // number of nodes in this subtree, gives O(log n) ranks
         
-        Node(Task t) : task(t), key(t.priority), left(nullptr), right(nullptr), height(1) {}
+        Node(Task t, const OrderKey& k) : task(std::move(t)), key(k), left(NIL), right(NIL), height(1), size(1) {}
     };
 
-    Node* root;
-    unordered_map<string, Node*> idMap; // fast lookup based on id
+    // Each slab is reserved once and never grows past SLAB_SIZE, so nodes
+    // never move. Slots below `used` have been handed out since the last
+    // clear(); freed ones are chained through Node::left starting at freeHead.
+    // Slots keep their Task after being freed or cleared and are reused by
+    // assignment, so rebuilding reuses the same memory.
+    vector<vector<Node>> slabs;
+    NodeIndex used;
+    NodeIndex freeHead;
+
+    NodeIndex root;
+    unordered_map<string, NodeIndex> idMap; // fast lookup based on id
+    long long maxSequence; // highest sequence seen, used to hand out the next one
+    TaskJournal* journal; // optional, notified of insert/update/delete
+    TaskOrder order;
 
-    int getHeight(Node* node) { return node ? node->height : 0; }
-    int getBalance(Node* node) { return node ? getHeight(node->left) - getHeight(node->right) : 0; }
+    // Secondary indexes, kept in step with the tree by insertNode, removeNode
+    // and rebuild. Per-category entries are ordered by OrderKey (status, then
+    // deadline under the default order), so a category + status + deadline
+    // filter is one range scan.
+    // The tree itself is the status index: all incomplete tasks come first.
+    unordered_map<uint32_t, map<OrderKey, NodeIndex>> categoryIndex;
+    map<pair<long, long long>, NodeIndex> deadlineIndex; // (remainingHours, sequence)
+    map<pair<long long, long long>, NodeIndex> dueIndex; // (dueAt, sequence), incomplete tasks only
+    // Words of description and category, built by the first searchText so
+    // loading never pays for it, then kept by insert and deleteTask: a status
+    // change leaves the words (and the node) as they were. The mutex only
+    // serializes that first build between concurrent readers.
+    mutable TextIndex textIndex;
+    mutable atomic<bool> textIndexReady;
+    mutable mutex textIndexMutex;
+
+    Node& node(NodeIndex index) { return slabs[index >> SLAB_BITS][index & (SLAB_SIZE - 1)]; }
+    const Node& node(NodeIndex index) const { return slabs[index >> SLAB_BITS][index & (SLAB_SIZE - 1)]; }
+
+    NodeIndex allocNode(Task&& task, const OrderKey& key) {
+        NodeIndex index;
+        if (freeHead != NIL) {
+            index = freeHead;
+            freeHead = node(index).left;
+        } else {
+            index = used++;
+            size_t slab = static_cast<size_t>(index >> SLAB_BITS);
+            if (slab == slabs.size()) {
+                slabs.emplace_back();
+                slabs.back().reserve(SLAB_SIZE);
+            }
+            vector<Node>& nodes = slabs[slab];
+            if (static_cast<size_t>(index & (SLAB_SIZE - 1)) == nodes.size()) {
+                nodes.emplace_back(std::move(task), key);
+                return index;
+            }
+        }
+        Node& n = node(index);
+        n.task = std::move(task);
+        n.key = key;
+        n.left = n.right = NIL;
+        n.height = 1;
+        n.size = 1;
+        return index;
+    }
+
+    void freeNode(NodeIndex index) {
+        node(index).left = freeHead;
+        freeHead = index;
+    }
+
+    void addToIndexes(const Node& n, NodeIndex index) {
+        map<OrderKey, NodeIndex>& byKey = categoryIndex[n.task.categoryId];
+        byKey.emplace_hint(byKey.end(), n.key, index);
+        deadlineIndex.emplace(make_pair(n.task.remainingHours, n.task.sequence), index);
+        if (!n.task.isComplete())
+            dueIndex.emplace(make_pair(n.task.dueAt, n.task.sequence), index);
+    }
+
+    void removeFromIndexes(const Node& n) {
+        auto category = categoryIndex.find(n.task.categoryId);
+        if (category != categoryIndex.end()) {
+            category->second.erase(n.key);
+            if (category->second.empty())
+                categoryIndex.erase(category);
+        }
+        deadlineIndex.erase(make_pair(n.task.remainingHours, n.task.sequence));
+        dueIndex.erase(make_pair(n.task.dueAt, n.task.sequence));
+    }
+
+    int getHeight(NodeIndex index) const { return index != NIL ? node(index).height : 0; }
+    int getSize(NodeIndex index) const { return index != NIL ? node(index).size : 0; }
+    int getBalance(NodeIndex index) {
+        return index != NIL ? getHeight(node(index).left) - getHeight(node(index).right) : 0;
+    }
 
-    void updateHeight(Node* node) {
-        if (node)
-            node->height = 1 + max(getHeight(node->left), getHeight(node->right));
+    // Recomputes height and subtree size from the children.
+    void updateHeight(NodeIndex index) {
+        if (index != NIL) {
+            Node& n = node(index);
+            n.height = 1 + max(getHeight(n.left), getHeight(n.right));
+            n.size = 1 + getSize(n.left) + getSize(n.right);
+        }
     }
 
-    Node* rotateLeft(Node* node) {
-        Node* newRoot = node->right;
-        node->right = newRoot->left;
-        newRoot->left = node;
-        updateHeight(node);
+    NodeIndex rotateLeft(NodeIndex index) {
+        NodeIndex newRoot = node(index).right;
+        node(index).right = node(newRoot).left;
+        node(newRoot).left = index;
+        updateHeight(index);
         updateHeight(newRoot);
         return newRoot;
     }
 
-    Node* rotateRight(Node* node) {
-        Node* newRoot = node->left;
-        node->left = newRoot->right;
-        newRoot->right = node;
-        updateHeight(node);
+    NodeIndex rotateRight(NodeIndex index) {
+        NodeIndex newRoot = node(index).left;
+        node(index).left = node(newRoot).right;
+        node(newRoot).right = index;
+        updateHeight(index);
         updateHeight(newRoot);
         return newRoot;
     }
 
-    Node* rotateLeftRight(Node* node) {
-        node->left = rotateLeft(node->left);
-        return rotateRight(node);
+    NodeIndex rotateLeftRight(NodeIndex index) {
+        node(index).left = rotateLeft(node(index).left);
+        return rotateRight(index);
     }
 
-    Node* rotateRightLeft(Node* node) {
-        node->right = rotateRight(node->right);
-        return rotateLeft(node);
+    NodeIndex rotateRightLeft(NodeIndex index) {
+        node(index).right = rotateRight(node(index).right);
+        return rotateLeft(index);
     }
 
-    Node* balance(Node* node) {
-        int balanceFactor = getBalance(node);
+    // Adds the number of single rotations done to rotations.
+    NodeIndex balance(NodeIndex index, int& rotations) {
+        int balanceFactor = getBalance(index);
         if (balanceFactor > 1) {
-            if (getBalance(node->left) < 0)
-                return rotateLeftRight(node);
-            else
-                return rotateRight(node);
+            if (getBalance(node(index).left) < 0) {
+                rotations += 2;
+                return rotateLeftRight(index);
+            }
+            rotations++;
+            return rotateRight(index);
         }
         if (balanceFactor < -1) {
-            if (getBalance(node->right) > 0)
-                return rotateRightLeft(node);
-            else
-                return rotateLeft(node);
+            if (getBalance(node(index).right) > 0) {
+                rotations += 2;
+                return rotateRightLeft(index);
+            }
+            rotations++;
+            return rotateLeft(index);
         }
-        return node;
+        return index;
     }
 
-    // Standard BST insert using task.priority as key.
-    Node* insertHelper(Node* node, Task task) {
-        if (!node) {
-            Node* newNode = new Node(task);
-            idMap[task.id] = newNode;
-            return newNode;
+    static const int MAX_DEPTH = 64; // an AVL tree of at most INT_MAX nodes is shallower
+
+    // Relinks child under path[depth - 1] (left if wentLeft), then rebalances
+    // every node on the path bottom-up and stores the resulting root.
+    // Returns the number of rotations.
+    int retrace(NodeIndex child, const NodeIndex* path, const bool* wentLeft, int depth) {
+        int rotations = 0;
+        while (depth > 0) {
+            --depth;
+            NodeIndex parent = path[depth];
+            if (wentLeft[depth])
+                node(parent).left = child;
+            else
+                node(parent).right = child;
+            updateHeight(parent);
+            child = balance(parent, rotations);
         }
-        if (task.priority < node->key)
-            node->left = insertHelper(node->left, task);
-        else if (task.priority > node->key)
-            node->right = insertHelper(node->right, task);
-        else
-            throw runtime_error("Duplicate priority encountered.");
-        
-        updateHeight(node);
-        return balance(node);
-    }
-
-    Node* findMin(Node* node) {
-        while (node && node->left)
-            node = node->left;
-        return node;
-    }
-
-    Node* deleteHelper(Node* node, int key) {
-        if (!node)
-            return nullptr;
-        if (key < node->key)
-            node->left = deleteHelper(node->left, key);
-        else if (key > node->key)
-            node->right = deleteHelper(node->right, key);
-        else {
-            idMap.erase(node->task.id);
-            if (!node->left || !node->right) {
-                Node* temp = node->left ? node->left : node->right;
-                delete node;
-                return temp;
+        root = child;
+        return rotations;
+    }
+
+    // Iterative BST insert using the task's OrderKey. The task is moved into
+    // its node, so its strings are never copied on the way down.
+    NodeIndex insertNode(Task&& task) {
+        NodeIndex path[MAX_DEPTH];
+        bool wentLeft[MAX_DEPTH];
+        int depth = 0;
+        OrderKey key = order.keyOf(task);
+        NodeIndex index = root;
+        while (index != NIL) {
+            const Node& n = node(index);
+            path[depth] = index;
+            if (key < n.key) {
+                wentLeft[depth++] = true;
+                index = n.left;
+            } else if (n.key < key) {
+                wentLeft[depth++] = false;
+                index = n.right;
             } else {
-                Node* minRight = findMin(node->right);
-                node->task = minRight->task;
-                node->key = minRight->key;
-                node->right = deleteHelper(node->right, minRight->key);
+                throw runtime_error("Duplicate ordering key encountered.");
             }
         }
-        updateHeight(node);
-        return balance(node);
+        maxSequence = max(maxSequence, task.sequence);
+        NodeIndex newNode = allocNode(std::move(task), key);
+        idMap[node(newNode).task.id] = newNode;
+        addToIndexes(node(newNode), newNode);
+        TASK_COUNT(insertRotations, retrace(newNode, path, wentLeft, depth));
+        return newNode;
     }
 
-    void inOrder(Node* node, vector<Task>& tasks) {
-        if (!node) return;
-        inOrder(node->left, tasks);
-        tasks.push_back(node->task);
-        inOrder(node->right, tasks);
+    // Iterative delete of the node holding key; the removed task is moved
+    // out and returned. A two-child node is replaced by relinking its
+    // successor node in its place, so every other task keeps its NodeIndex.
+    Task removeNode(const OrderKey& key) {
+        NodeIndex path[MAX_DEPTH];
+        bool wentLeft[MAX_DEPTH];
+        int depth = 0;
+        NodeIndex index = root;
+        while (index != NIL) {
+            const Node& n = node(index);
+            if (key < n.key) {
+                path[depth] = index;
+                wentLeft[depth++] = true;
+                index = n.left;
+            } else if (n.key < key) {
+                path[depth] = index;
+                wentLeft[depth++] = false;
+                index = n.right;
+            } else {
+                break;
+            }
+        }
+        if (index == NIL)
+            throw runtime_error("Task not found in tree.");
+
+        Node& target = node(index);
+        idMap.erase(target.task.id);
+        removeFromIndexes(target);
+        Task removed = std::move(target.task);
+        NodeIndex replacement;
+        if (target.left != NIL && target.right != NIL) {
+            // The successor takes target's place in the path; retracing
+            // relinks its old parent to its right child.
+            int targetDepth = depth;
+            path[depth] = index;
+            wentLeft[depth++] = false;
+            NodeIndex successor = target.right;
+            while (node(successor).left != NIL) {
+                path[depth] = successor;
+                wentLeft[depth++] = true;
+                successor = node(successor).left;
+            }
+            Node& s = node(successor);
+            replacement = s.right;
+            s.left = target.left;
+            s.right = target.right;
+            path[targetDepth] = successor;
+        } else {
+            replacement = target.left != NIL ? target.left : target.right;
+        }
+        freeNode(index);
+        TASK_COUNT(deleteRotations, retrace(replacement, path, wentLeft, depth));
+        return removed;
     }
 
-    // Clears all nodes in the AVL tree.
-    void clear(Node* node) {
-        if (!node) return;
-        clear(node->left);
-        clear(node->right);
-        delete node;
+    // Builds a perfectly balanced subtree from tasks[sortedSlots[first..last]],
+    // where sortedSlots lists task indices in key order. O(n), no rotations.
+    // Nodes are allocated in key order so in-order traversal walks the pool
+    // sequentially.
+    NodeIndex buildHelper(vector<Task>& tasks, const vector<size_t>& sortedSlots, int first, int last) {
+        if (first > last) return NIL;
+        int mid = first + (last - first) / 2;
+        NodeIndex left = buildHelper(tasks, sortedSlots, first, mid - 1);
+        Task& task = tasks[sortedSlots[mid]];
+        NodeIndex index = allocNode(std::move(task), order.keyOf(task));
+        Node& n = node(index);
+        if (!idMap.emplace(n.task.id, index).second)
+            throw runtime_error("Duplicate task ID encountered: " + n.task.id);
+        addToIndexes(n, index);
+        maxSequence = max(maxSequence, n.task.sequence);
+        n.left = left;
+        n.right = buildHelper(tasks, sortedSlots, mid + 1, last);
+        updateHeight(index);
+        return index;
     }
 
-public:
-    AVLTree() : root(nullptr) {}
+    // Sorts (key, position) pairs by key. When the status, primary and
+    // sequence ranges pack into one 64-bit integer (the usual case) this is
+    // an LSD radix sort with 11-bit digits, a few linear passes; otherwise,
+    // or for small inputs, std::sort.
+    template <typename Position>
+    static void sortKeys(vector<pair<OrderKey, Position>>& keys) {
+        auto byKey = [](const pair<OrderKey, Position>& a, const pair<OrderKey, Position>& b) { return a.first < b.first; };
+        if (is_sorted(keys.begin(), keys.end(), byKey))
+            return;
+        if (keys.size() < 4096 || keys.size() > UINT32_MAX) {
+            sort(keys.begin(), keys.end(), byKey);
+            return;
+        }
+        long minHours = LONG_MAX, maxHours = LONG_MIN;
+        long long minSequence = LLONG_MAX, maxSequence = LLONG_MIN;
+        for (const auto &entry : keys) {
+            minHours = min(minHours, entry.first.primary);
+            maxHours = max(maxHours, entry.first.primary);
+            minSequence = min(minSequence, entry.first.sequence);
+            maxSequence = max(maxSequence, entry.first.sequence);
+        }
+        auto bitsFor = [](uint64_t range) {
+            int bits = 0;
+            while (bits < 64 && (range >> bits) != 0)
+                bits++;
+            return bits;
+        };
+        int hoursBits = bitsFor(static_cast<uint64_t>(maxHours) - static_cast<uint64_t>(minHours));
+        int sequenceBits = bitsFor(static_cast<uint64_t>(maxSequence) - static_cast<uint64_t>(minSequence));
+        int keyBits = 1 + hoursBits + sequenceBits;
+        if (keyBits > 64) {
+            sort(keys.begin(), keys.end(), byKey);
+            return;
+        }
+        vector<pair<uint64_t, uint32_t>> packed(keys.size()), scratch(keys.size());
+        for (size_t i = 0; i < keys.size(); i++) {
+            const OrderKey& k = keys[i].first;
+            packed[i].first = static_cast<uint64_t>(k.statusRank) << (hoursBits + sequenceBits) |
+                              (static_cast<uint64_t>(k.primary) - static_cast<uint64_t>(minHours)) << sequenceBits |
+                              (static_cast<uint64_t>(k.sequence) - static_cast<uint64_t>(minSequence));
+            packed[i].second = static_cast<uint32_t>(i);
+        }
+        const int DIGIT_BITS = 11;
+        const size_t BUCKETS = size_t(1) << DIGIT_BITS;
+        for (int shift = 0; shift < keyBits; shift += DIGIT_BITS) {
+            size_t offsets[BUCKETS + 1] = {};
+            for (const auto &entry : packed)
+                offsets[((entry.first >> shift) & (BUCKETS - 1)) + 1]++;
+            for (size_t b = 1; b <= BUCKETS; b++)
+                offsets[b] += offsets[b - 1];
+            for (const auto &entry : packed)
+                scratch[offsets[(entry.first >> shift) & (BUCKETS - 1)]++] = entry;
+            packed.swap(scratch);
+        }
+        vector<pair<OrderKey, Position>> sorted;
+        sorted.reserve(keys.size());
+        for (const auto &entry : packed)
+            sorted.push_back(keys[entry.second]);
+        keys.swap(sorted);
+    }
 
-    ~AVLTree() {
-        clear(root);
-        idMap.clear();
+    // Links the nodes in keys[first..last] (already sorted) into a perfectly
+    // balanced subtree, reusing them in place.
+    NodeIndex linkBalanced(const vector<pair<OrderKey, NodeIndex>>& keys, int first, int last) {
+        if (first > last) return NIL;
+        int mid = first + (last - first) / 2;
+        NodeIndex index = keys[mid].second;
+        Node& n = node(index);
+        n.left = linkBalanced(keys, first, mid - 1);
+        n.right = linkBalanced(keys, mid + 1, last);
+        updateHeight(index);
+        return index;
     }
 
-    // Inserts a task (task.priority should be set correctly beforehand)
-    void insert(Task task) {
+    // Insert and delete without the journal, shared by insert/load and
+    // deleteTask/unload.
+    NodeIndex place(Task&& task) {
         if (idMap.find(task.id) != idMap.end())
             throw runtime_error("Task with the same ID already exists.");
-        root = insertHelper(root, task);
+        NodeIndex index = insertNode(std::move(task));
+        if (textIndexReady)
+            textIndex.add(node(index).task, index);
+        return index;
     }
 
-    // Rebuilds the entire tree from a sorted vector of tasks.
-    void rebuild(const vector<Task>& tasks) {
-        clear(root);
-        root = nullptr;
+    void displace(const string& id) {
+        auto it = idMap.find(id);
+        if (it == idMap.end())
+            throw runtime_error("Task ID not found.");
+        NodeIndex index = it->second;
+        if (textIndexReady)
+            textIndex.remove(node(index).task, index);
+        OrderKey key = node(index).key;
+        removeNode(key);
+    }
+
+    // Releases every node at once: the pool is reset, not walked.
+    void clear() {
+        root = NIL;
+        used = 0;
+        freeHead = NIL;
         idMap.clear();
-        for (const auto& t : tasks) {
-            root = insertHelper(root, t);
+        categoryIndex.clear();
+        deadlineIndex.clear();
+        dueIndex.clear();
+        textIndex.clear();
+        textIndexReady = false;
+    }
+
+    void ensureTextIndex() const {
+        if (textIndexReady.load(memory_order_acquire))
+            return;
+        lock_guard<mutex> guard(textIndexMutex);
+        if (textIndexReady.load(memory_order_relaxed))
+            return;
+        // In index order, so every posting list is built by appending.
+        vector<NodeIndex> indexes;
+        indexes.reserve(idMap.size());
+        for (const auto &entry : idMap)
+            indexes.push_back(entry.second);
+        sort(indexes.begin(), indexes.end());
+        for (NodeIndex index : indexes)
+            textIndex.add(node(index).task, index);
+        textIndexReady.store(true, memory_order_release);
+    }
+
+    static void invariantFailed(const string& what) {
+        throw runtime_error("Tree invariant violated: " + what);
+    }
+
+    // Checks heights, balance and sizes below index, appending the nodes to
+    // inOrder in order; returns the subtree height.
+    int checkSubtree(NodeIndex index, int depth, vector<NodeIndex>& inOrder) const {
+        if (index == NIL)
+            return 0;
+        if (depth > MAX_DEPTH)
+            invariantFailed("depth exceeds " + to_string(MAX_DEPTH));
+        const Node& n = node(index);
+        int leftHeight = checkSubtree(n.left, depth + 1, inOrder);
+        inOrder.push_back(index);
+        int rightHeight = checkSubtree(n.right, depth + 1, inOrder);
+        if (n.height != 1 + max(leftHeight, rightHeight))
+            invariantFailed("stale height at task " + n.task.id);
+        if (abs(leftHeight - rightHeight) > 1)
+            invariantFailed("unbalanced at task " + n.task.id);
+        if (n.size != 1 + getSize(n.left) + getSize(n.right))
+            invariantFailed("stale subtree size at task " + n.task.id);
+        return n.height;
+    }
+
+public:
+    // In-order iterator over the tasks as const references. The path to the
+    // current node is kept in a fixed array, so iterating never allocates or
+    // copies a Task. Invalidated by any mutation of the tree.
+    class const_iterator {
+    private:
+        friend class AVLTree;
+        const AVLTree* tree;
+        NodeIndex path[MAX_DEPTH];
+        int depth;
+        int position; // priority of the current task; size() + 1 at the end
+
+        const_iterator(const AVLTree* t, int pos) : tree(t), depth(0), position(pos) {}
+
+        void pushLeft(NodeIndex index) {
+            while (index != NIL) {
+                path[depth++] = index;
+                index = tree->node(index).left;
+            }
+        }
+
+    public:
+        typedef forward_iterator_tag iterator_category;
+        typedef Task value_type;
+        typedef ptrdiff_t difference_type;
+        typedef const Task* pointer;
+        typedef const Task& reference;
+
+        const Task& operator*() const { return tree->node(path[depth - 1]).task; }
+        const Task* operator->() const { return &tree->node(path[depth - 1]).task; }
+
+        // Priority of the current task (Task::priority is not kept on nodes).
+        int priority() const { return position; }
+
+        const_iterator& operator++() {
+            NodeIndex current = path[--depth];
+            pushLeft(tree->node(current).right);
+            position++;
+            return *this;
+        }
+
+        bool operator==(const const_iterator& other) const { return position == other.position; }
+        bool operator!=(const const_iterator& other) const { return position != other.position; }
+    };
+
+    // A [first, last) slice of the ordering, usable in range-for.
+    struct TaskRange {
+        const_iterator first;
+        const_iterator last;
+        const_iterator begin() const { return first; }
+        const_iterator end() const { return last; }
+    };
+
+    AVLTree() : used(0), freeHead(NIL), root(NIL), maxSequence(0), journal(nullptr), textIndexReady(false) {}
+
+    // Inserts a task at the position given by its OrderKey. Only the search
+    // path is touched; other tasks keep their keys. Pass an rvalue (or use
+    // emplace) to avoid copying the task at all.
+    void insert(Task task) {
+        TASK_TIME(treeInsert);
+        NodeIndex index = place(std::move(task));
+        if (journal)
+            journal->recordUpsert(node(index).task);
+    }
+
+    // Adds a task that storage already holds, without telling the journal,
+    // for paging tasks in on demand (TaskStore's hot-set mode).
+    void load(Task task) {
+        place(std::move(task));
+    }
+
+    // Drops a task from memory only, without telling the journal; storage
+    // keeps it.
+    void unload(const string& id) {
+        displace(id);
+    }
+
+    // Constructs the task in place and inserts it.
+    template <typename... Args>
+    void emplace(Args&&... args) {
+        insert(Task(std::forward<Args>(args)...));
+    }
+
+    // Attaches a journal that records every later mutation (nullptr detaches).
+    // rebuild() is not recorded: it is used to load what is already stored.
+    void setJournal(TaskJournal* j) {
+        journal = j;
+    }
+
+    // Switches the ordering policy and re-sorts the tasks held, as rebuild
+    // does; priorities change, the tasks do not (nothing is journaled).
+    void setOrder(TaskOrder o) {
+        order = std::move(o);
+        if (root != NIL)
+            rebuild(listTasks());
+    }
+
+    const TaskOrder& ordering() const { return order; }
+
+    // Key of task under this tree's order, as compared by lowerBound.
+    OrderKey keyOf(const Task& task) const { return order.keyOf(task); }
+
+    // Rebuilds the entire tree from a vector of tasks in any order. Only the
+    // (key, index) pairs are sorted, and that is skipped when the tasks are
+    // already in key order; the tree is then built bottom-up in O(n).
+    void rebuild(vector<Task> tasks) {
+        TASK_TIME(treeRebuild);
+        clear();
+        maxSequence = 0;
+        vector<pair<OrderKey, size_t>> keys;
+        keys.reserve(tasks.size());
+        for (size_t i = 0; i < tasks.size(); i++)
+            keys.emplace_back(order.keyOf(tasks[i]), i);
+        sortKeys(keys);
+        vector<size_t> sortedSlots; // indexes into tasks, in key order
+        sortedSlots.reserve(keys.size());
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (i > 0 && !(keys[i - 1].first < keys[i].first))
+                throw runtime_error("Duplicate ordering key encountered.");
+            sortedSlots.push_back(keys[i].second);
+        }
+        idMap.reserve(tasks.size());
+        try {
+            root = buildHelper(tasks, sortedSlots, 0, static_cast<int>(sortedSlots.size()) - 1);
+            TASK_COUNT(tasksRebuilt, tasks.size());
+        } catch (const runtime_error &) {
+            clear();
+            throw;
         }
     }
 
-    // Update task status directly (this does not reassign priority order)
-    void updateTaskStatus(string id, string newStatus) {
-        if (idMap.find(id) == idMap.end())
+    // Re-derives every task's remainingHours from its due time as of now
+    // (whole hours, rounded up; negative once overdue) and re-prioritizes all
+    // tasks in one pass: the new (key, node) pairs are sorted with sortKeys
+    // and the existing nodes relinked bottom-up, so no task moves and the ID
+    // map, due-time index and word index stay valid. Tasks whose hours
+    // changed are reported to the journal; returns how many there were.
+    size_t recomputeDeadlines(long long now) {
+        TASK_TIME(treeRecomputeDeadlines);
+        vector<pair<OrderKey, NodeIndex>> keys;
+        keys.reserve(idMap.size());
+        vector<NodeIndex> changed;
+        // In the current order, so keys that keep their order need no sort.
+        vector<NodeIndex> stack;
+        NodeIndex current = root;
+        while (current != NIL || !stack.empty()) {
+            for (; current != NIL; current = node(current).left)
+                stack.push_back(current);
+            current = stack.back();
+            stack.pop_back();
+            Node& n = node(current);
+            long long seconds = n.task.dueAt - now;
+            long hours = static_cast<long>(seconds / 3600 + (seconds % 3600 > 0 ? 1 : 0));
+            if (hours != n.task.remainingHours) {
+                n.task.remainingHours = hours;
+                n.key = order.keyOf(n.task);
+                changed.push_back(current);
+            }
+            keys.emplace_back(n.key, current);
+            current = n.right;
+        }
+        if (changed.empty())
+            return 0;
+        sortKeys(keys);
+        root = linkBalanced(keys, 0, static_cast<int>(keys.size()) - 1);
+
+        // Both indexes are keyed on remainingHours. Their map nodes are
+        // extracted, rekeyed and appended back in order, without allocating:
+        // per category straight from keys, and by deadline by merging the
+        // incomplete and complete runs of keys (sorting instead when the
+        // order is not by remaining hours).
+        vector<map<OrderKey, NodeIndex>::node_type> categoryNodes(used);
+        for (auto &category : categoryIndex) {
+            while (!category.second.empty()) {
+                auto handle = category.second.extract(category.second.begin());
+                categoryNodes[handle.mapped()] = std::move(handle);
+            }
+        }
+        vector<map<pair<long, long long>, NodeIndex>::node_type> deadlineNodes(used);
+        while (!deadlineIndex.empty()) {
+            auto handle = deadlineIndex.extract(deadlineIndex.begin());
+            deadlineNodes[handle.mapped()] = std::move(handle);
+        }
+        for (const auto &entry : keys) {
+            map<OrderKey, NodeIndex>& byKey = categoryIndex[node(entry.second).task.categoryId];
+            auto& handle = categoryNodes[entry.second];
+            handle.key() = entry.first;
+            byKey.insert(byKey.end(), std::move(handle));
+        }
+        vector<pair<pair<long, long long>, NodeIndex>> byDeadline;
+        byDeadline.reserve(keys.size());
+        if (order.policy == TaskOrder::ByRemainingHours) {
+            size_t split = partition_point(keys.begin(), keys.end(), [](const pair<OrderKey, NodeIndex>& entry) {
+                return entry.first.statusRank == 0;
+            }) - keys.begin();
+            size_t a = 0, b = split;
+            while (a < split || b < keys.size()) {
+                bool takeA = b == keys.size() ||
+                             (a < split && make_pair(keys[a].first.primary, keys[a].first.sequence) <
+                                               make_pair(keys[b].first.primary, keys[b].first.sequence));
+                const pair<OrderKey, NodeIndex>& entry = keys[takeA ? a++ : b++];
+                byDeadline.emplace_back(make_pair(entry.first.primary, entry.first.sequence), entry.second);
+            }
+        } else {
+            for (const auto &entry : keys) {
+                const Task& task = node(entry.second).task;
+                byDeadline.emplace_back(make_pair(task.remainingHours, task.sequence), entry.second);
+            }
+            sort(byDeadline.begin(), byDeadline.end());
+        }
+        for (const auto &entry : byDeadline) {
+            auto& handle = deadlineNodes[entry.second];
+            handle.key() = entry.first;
+            deadlineIndex.insert(deadlineIndex.end(), std::move(handle));
+        }
+        if (journal) {
+            for (NodeIndex index : changed)
+                journal->recordUpsert(node(index).task);
+        }
+        return changed.size();
+    }
+
+    // Updates a task's status and moves it to its new position: the task is
+    // removed under its old key and reinserted under the new one. O(log n).
+    void updateTaskStatus(string id, TaskStatus newStatus) {
+        TASK_TIME(treeUpdateStatus);
+        auto it = idMap.find(id);
+        if (it == idMap.end())
             throw runtime_error("Task ID not found.");
-        idMap[id]->task.status = newStatus;
+        NodeIndex oldIndex = it->second;
+        Node& n = node(oldIndex);
+        if (n.task.status == newStatus)
+            return;
+        Task task = removeNode(n.key);
+        task.status = newStatus;
+        NodeIndex index = insertNode(std::move(task));
+        if (index != oldIndex && textIndexReady) {
+            // The freed node is normally reused at once; move the words if not.
+            textIndex.remove(node(index).task, oldIndex);
+            textIndex.add(node(index).task, index);
+        }
+        if (journal)
+            journal->recordUpsert(node(index).task);
     }
 
     void deleteTask(string id) {
-        if (idMap.find(id) == idMap.end())
+        TASK_TIME(treeDelete);
+        displace(id);
+        if (journal)
+            journal->recordDelete(id);
+    }
+
+    // Sequence to assign to the next inserted task.
+    long long nextSequence() const {
+        return maxSequence + 1;
+    }
+
+    int size() const {
+        return getSize(root);
+    }
+
+    // Checks every structural invariant, for stress tests: AVL balance,
+    // heights and subtree sizes, strictly increasing keys that match each
+    // task under the current order, the ID map, the secondary indexes, and
+    // that rankOf gives each task its in-order position. Throws
+    // runtime_error naming the first violation. O(n log n).
+    void checkInvariants() const {
+        vector<NodeIndex> inOrder;
+        inOrder.reserve(idMap.size());
+        checkSubtree(root, 1, inOrder);
+        if (inOrder.size() != idMap.size())
+            invariantFailed(to_string(inOrder.size()) + " nodes but " + to_string(idMap.size()) + " IDs");
+        size_t incomplete = 0;
+        for (size_t i = 0; i < inOrder.size(); i++) {
+            const Node& n = node(inOrder[i]);
+            if (i > 0 && !(node(inOrder[i - 1]).key < n.key))
+                invariantFailed("keys out of order at task " + n.task.id);
+            OrderKey expected = order.keyOf(n.task);
+            if (expected < n.key || n.key < expected)
+                invariantFailed("stale key at task " + n.task.id);
+            auto id = idMap.find(n.task.id);
+            if (id == idMap.end() || id->second != inOrder[i])
+                invariantFailed("ID map does not point at task " + n.task.id);
+            if (n.task.sequence > maxSequence)
+                invariantFailed("sequence above maxSequence at task " + n.task.id);
+            auto category = categoryIndex.find(n.task.categoryId);
+            if (category == categoryIndex.end() || category->second.count(n.key) == 0 ||
+                category->second.at(n.key) != inOrder[i])
+                invariantFailed("category index misses task " + n.task.id);
+            auto deadline = deadlineIndex.find(make_pair(n.task.remainingHours, n.task.sequence));
+            if (deadline == deadlineIndex.end() || deadline->second != inOrder[i])
+                invariantFailed("deadline index misses task " + n.task.id);
+            if (!n.task.isComplete()) {
+                incomplete++;
+                auto due = dueIndex.find(make_pair(n.task.dueAt, n.task.sequence));
+                if (due == dueIndex.end() || due->second != inOrder[i])
+                    invariantFailed("due index misses task " + n.task.id);
+            }
+            if (rankOf(n.task.id) != static_cast<int>(i) + 1)
+                invariantFailed("rankOf disagrees with position for task " + n.task.id);
+        }
+        size_t categorized = 0;
+        for (const auto &category : categoryIndex)
+            categorized += category.second.size();
+        if (categorized != inOrder.size() || deadlineIndex.size() != inOrder.size() || dueIndex.size() != incomplete)
+            invariantFailed("secondary indexes hold entries for tasks not in the tree");
+    }
+
+    // 1-based priority of a task, i.e. its position in the ordering. O(log n).
+    int rankOf(const string& id) const {
+        auto it = idMap.find(id);
+        if (it == idMap.end())
             throw runtime_error("Task ID not found.");
-        int key = idMap[id]->key;
-        root = deleteHelper(root, key);
+        const OrderKey& key = node(it->second).key;
+        int rank = 0;
+        NodeIndex index = root;
+        while (index != NIL) {
+            const Node& n = node(index);
+            if (key < n.key) {
+                index = n.left;
+            } else if (n.key < key) {
+                rank += getSize(n.left) + 1;
+                index = n.right;
+            } else {
+                return rank + getSize(n.left) + 1;
+            }
+        }
+        throw runtime_error("Task ID not found in tree.");
+    }
+
+    // Returns the task holding priority k (1-based). O(log n).
+    Task selectByRank(int k) const {
+        if (k < 1 || k > size())
+            throw runtime_error("Priority out of range.");
+        NodeIndex index = root;
+        int remaining = k;
+        while (true) {
+            const Node& n = node(index);
+            int leftSize = getSize(n.left);
+            if (remaining <= leftSize) {
+                index = n.left;
+            } else if (remaining == leftSize + 1) {
+                Task task = n.task;
+                task.priority = k;
+                return task;
+            } else {
+                remaining -= leftSize + 1;
+                index = n.right;
+            }
+        }
+    }
+
+    // Returns tasks with priorities first..last (inclusive, clamped to the
+    // tree). O(log n + number of tasks returned).
+    vector<Task> range(int first, int last) const {
+        vector<Task> tasks;
+        first = max(first, 1);
+        last = min(last, size());
+        if (first > last)
+            return tasks;
+        tasks.reserve(last - first + 1);
+        for (const_iterator it = iteratorAt(first); it.priority() <= last; ++it) {
+            tasks.push_back(*it);
+            tasks.back().priority = it.priority();
+        }
+        return tasks;
+    }
+
+    const_iterator begin() const {
+        const_iterator it(this, 1);
+        it.pushLeft(root);
+        return it;
+    }
+
+    const_iterator end() const {
+        return const_iterator(this, getSize(root) + 1);
+    }
+
+    // Iterator positioned at priority k (1-based), found in O(log n).
+    const_iterator iteratorAt(int k) const {
+        if (k < 1 || k > getSize(root))
+            return end();
+        const_iterator it(this, k);
+        NodeIndex index = root;
+        int remaining = k;
+        while (index != NIL) {
+            const Node& n = node(index);
+            int leftSize = getSize(n.left);
+            if (remaining <= leftSize) {
+                it.path[it.depth++] = index;
+                index = n.left;
+            } else if (remaining == leftSize + 1) {
+                it.path[it.depth++] = index;
+                break;
+            } else {
+                remaining -= leftSize + 1;
+                index = n.right;
+            }
+        }
+        return it;
+    }
+
+    // Iterator at the first task whose key is not less than key. O(log n).
+    const_iterator lowerBound(const OrderKey& key) const {
+        const_iterator it(this, getSize(root) + 1);
+        NodeIndex index = root;
+        int rank = 0;
+        while (index != NIL) {
+            const Node& n = node(index);
+            if (n.key < key) {
+                rank += getSize(n.left) + 1;
+                index = n.right;
+            } else {
+                it.path[it.depth++] = index;
+                it.position = rank + getSize(n.left) + 1;
+                index = n.left;
+            }
+        }
+        return it;
+    }
+
+    // Keyword search over description and category. Every word of text must
+    // start some word of the task (case-insensitive); tasks matching more of
+    // the words in full rank first, then by priority. Calls visitor(task,
+    // priority) for the matches after the first offset ones, at most limit,
+    // and returns the total number of matches.
+    template <typename Visitor>
+    size_t searchText(const string& text, Visitor visitor, size_t offset = 0, size_t limit = SIZE_MAX) const {
+        vector<string> prefixes = TextIndex::words(text);
+        if (prefixes.empty())
+            return 0;
+        ensureTextIndex();
+        struct Hit {
+            int score; // query words matched as whole words
+            NodeIndex index;
+        };
+        size_t chosen;
+        const vector<int>* exactNodes;
+        vector<int> nodes = textIndex.candidates(prefixes, chosen, exactNodes);
+        // How each category in the tree matches each prefix: 0 not at all,
+        // 1 as a prefix, 2 as a whole word. Saves a dictionary lookup per task.
+        uint32_t categories = 0;
+        for (const auto &category : categoryIndex)
+            categories = max(categories, category.first + 1);
+        vector<vector<uint8_t>> categoryMatch(prefixes.size(), vector<uint8_t>(categories, 0));
+        for (size_t p = 0; p < prefixes.size(); p++) {
+            for (const auto &category : categoryIndex) {
+                bool exact = false;
+                if (TextIndex::matches(CategoryDictionary::shared().name(category.first), prefixes[p], exact))
+                    categoryMatch[p][category.first] = exact ? 2 : 1;
+            }
+        }
+        vector<Hit> hits;
+        size_t exactCursor = 0;
+        for (int index : nodes) {
+            const Task& task = node(index).task;
+            // The candidates all contain the chosen prefix; the index says
+            // whether as a whole word.
+            while (exactNodes && exactCursor < exactNodes->size() && (*exactNodes)[exactCursor] < index)
+                exactCursor++;
+            int score = exactNodes && exactCursor < exactNodes->size() && (*exactNodes)[exactCursor] == index;
+            bool all = true;
+            for (size_t p = 0; p < prefixes.size() && all; p++) {
+                if (p == chosen)
+                    continue;
+                bool exact = false;
+                bool found = TextIndex::matches(task.description, prefixes[p], exact);
+                uint8_t category = categoryMatch[p][task.categoryId];
+                all = found || category;
+                score += exact || category == 2;
+            }
+            if (all)
+                hits.push_back(Hit{score, index});
+        }
+        if (offset >= hits.size())
+            return hits.size();
+        auto better = [this](const Hit& a, const Hit& b) {
+            if (a.score != b.score)
+                return a.score > b.score;
+            return node(a.index).key < node(b.index).key;
+        };
+        size_t end = hits.size() - offset > limit ? offset + limit : hits.size();
+        partial_sort(hits.begin(), hits.begin() + end, hits.end(), better);
+        for (size_t i = offset; i < end; i++) {
+            const Task& task = node(hits[i].index).task;
+            visitor(task, rankOf(task.id));
+        }
+        return hits.size();
+    }
+
+    // Calls visitor(task) for each task matching q, stopping after limit
+    // matches; returns the number visited. Results come in priority order,
+    // except deadline-only queries, which come in deadline order. Runs in
+    // O(log n + matches) using the category index, the tree or the deadline
+    // index depending on which fields are set.
+    template <typename Visitor>
+    size_t query(const TaskQuery& q, Visitor visitor, size_t limit = SIZE_MAX) const {
+        size_t visited = 0;
+        if (q.minRemainingHours > q.maxRemainingHours || limit == 0)
+            return 0;
+        int firstRank = q.status ? (*q.status == TaskStatus::Complete ? 1 : 0) : 0;
+        int lastRank = q.status ? firstRank : 1;
+        // Other orders scan each status run, filtering on remaining hours.
+        bool byHours = order.policy == TaskOrder::ByRemainingHours;
+
+        if (q.category) {
+            optional<uint32_t> categoryId = CategoryDictionary::shared().find(*q.category);
+            if (!categoryId)
+                return 0;
+            auto category = categoryIndex.find(*categoryId);
+            if (category == categoryIndex.end())
+                return 0;
+            const map<OrderKey, NodeIndex>& byKey = category->second;
+            for (int rank = firstRank; rank <= lastRank; rank++) {
+                auto it = byKey.lower_bound(OrderKey{rank, byHours ? q.minRemainingHours : LONG_MIN, LLONG_MIN});
+                for (; it != byKey.end() && it->first.statusRank == rank &&
+                       (!byHours || it->first.primary <= q.maxRemainingHours); ++it) {
+                    const Task& task = node(it->second).task;
+                    if (!byHours && (task.remainingHours < q.minRemainingHours || task.remainingHours > q.maxRemainingHours))
+                        continue;
+                    visitor(task);
+                    if (++visited == limit)
+                        return visited;
+                }
+            }
+        } else if (q.status) {
+            auto it = lowerBound(OrderKey{firstRank, byHours ? q.minRemainingHours : LONG_MIN, LLONG_MIN});
+            for (; it != end(); ++it) {
+                OrderKey key = order.keyOf(*it);
+                if (key.statusRank != firstRank || (byHours && key.primary > q.maxRemainingHours))
+                    break;
+                if (!byHours && (it->remainingHours < q.minRemainingHours || it->remainingHours > q.maxRemainingHours))
+                    continue;
+                visitor(*it);
+                if (++visited == limit)
+                    break;
+            }
+        } else {
+            auto it = deadlineIndex.lower_bound(make_pair(q.minRemainingHours, LLONG_MIN));
+            for (; it != deadlineIndex.end() && it->first.first <= q.maxRemainingHours; ++it) {
+                visitor(node(it->second).task);
+                if (++visited == limit)
+                    break;
+            }
+        }
+        return visited;
+    }
+
+    // Calls visitor(task) for incomplete tasks due in [from, to], earliest
+    // first, stopping after limit; returns the number visited. With no bounds
+    // this lists the next tasks due. O(log n + matches).
+    template <typename Visitor>
+    size_t forEachDue(long long from, long long to, Visitor visitor, size_t limit = SIZE_MAX) const {
+        size_t visited = 0;
+        auto it = dueIndex.lower_bound(make_pair(from, LLONG_MIN));
+        for (; it != dueIndex.end() && it->first.first <= to && visited < limit; ++it, ++visited)
+            visitor(node(it->second).task);
+        return visited;
+    }
+
+    // Calls visitor(task, priority) for every task in order, without copying.
+    template <typename Visitor>
+    void forEach(Visitor visitor) const {
+        for (const_iterator it = begin(); it != end(); ++it)
+            visitor(*it, it.priority());
     }
 
-    Task* search(string id) {
-        return idMap.find(id) != idMap.end() ? &idMap[id]->task : nullptr;
+    // Up to limit tasks starting after the first offset ones (one page of
+    // the list). O(log n) to position, then O(1) amortized per task.
+    TaskRange listRange(int offset, int limit) const {
+        int total = getSize(root);
+        offset = max(offset, 0);
+        int last = static_cast<int>(min(static_cast<long long>(total), static_cast<long long>(offset) + max(limit, 0)));
+        if (offset >= last)
+            return TaskRange{end(), end()};
+        return TaskRange{iteratorAt(offset + 1), const_iterator(this, last + 1)};
     }
 
-    vector<Task> listTasks() {
+    // The pointer stays valid until the task is deleted or the tree rebuilt.
+    // Read-only: the tree's order and indexes are keyed on the task's
+    // fields, so changes go through updateTaskStatus and the like.
+    const Task* search(const string& id) const {
+        auto it = idMap.find(id);
+        return it != idMap.end() ? &node(it->second).task : nullptr;
+    }
+
+    // Copies every task in order, with priority filled in. Prefer forEach or
+    // iteration when a copy is not needed.
+    vector<Task> listTasks() const {
         vector<Task> tasks;
-        inOrder(root, tasks);
+        tasks.reserve(size());
+        for (const_iterator it = begin(); it != end(); ++it) {
+            tasks.push_back(*it);
+            tasks.back().priority = it.priority();
+        }
         return tasks;
     }
 };
 
-class DBManager {
+// Connection settings applied once when a DBManager opens the database.
+// The defaults favour an interactive writer with concurrent readers: WAL lets
+// a reporting process read while we write, and synchronous=NORMAL only syncs
+// at checkpoints instead of on every commit.
+struct StorageProfile {
+    string journalMode = "WAL";
+    string synchronous = "NORMAL";
+    int cacheSizeKiB = 64 * 1024;               // page cache per connection
+    long long mmapSizeBytes = 256LL * 1024 * 1024; // 0 disables memory mapping
+    bool tempStoreInMemory = true;
+    int busyTimeoutMs = 5000;                   // wait this long on a locked database
+};
+
+// Where tasks persist between runs: loaded once at startup, then kept up to
+// date with the ChangeSets the journals collect. DBManager stores them in
+// SQLite; LogStorage (TaskLogStorage.h) in a binary snapshot plus an
+// append-only operation log.
+class TaskStorage {
+public:
+    virtual ~TaskStorage() {}
+    virtual vector<Task> loadTasks() = 0;
+    // Applies every change or none of them.
+    virtual void writeChanges(const ChangeSet& changes) = 0;
+};
+
+// Columns DBManager::readTasks expects, in order.
+#define TASK_COLUMNS "id, description, deadlineDetails, priority, category, status, remainingHours, dueAt"
+
+// Owns one SQLite connection for the lifetime of the program and caches a
+// prepared statement per query, so each call only binds, steps and resets.
+class DBManager : public TaskStorage {
+private:
+    sqlite3* db;
+    sqlite3_stmt* insertStmt;
+    sqlite3_stmt* updateStmt;
+    sqlite3_stmt* deleteStmt;
+    sqlite3_stmt* selectStmt;
+    sqlite3_stmt* upsertStmt;
+    sqlite3_stmt* countStmt;
+    sqlite3_stmt* batchInsertStmt; // multi-row INSERT for batchInsertRows rows
+    int batchInsertRows;
+    // Lookups for TaskStore's hot-set mode.
+    sqlite3_stmt* findStmt;
+    sqlite3_stmt* incompleteStmt;
+    sqlite3_stmt* completePageStmt;
+    sqlite3_stmt* completeCountStmt;
+    sqlite3_stmt* completeBeforeStmt;
+    sqlite3_stmt* maxSequenceStmt;
+    string table;
+
+    // SQL below names the table $table; it is substituted before preparing.
+    string forTable(const string& sql) const {
+        string text;
+        size_t start = 0, marker;
+        while ((marker = sql.find("$table", start)) != string::npos) {
+            text.append(sql, start, marker - start);
+            text += table;
+            start = marker + 6;
+        }
+        return text.append(sql, start, string::npos);
+    }
+
+    // Prepares sql into slot on first use and returns the cached handle.
+    sqlite3_stmt* statement(sqlite3_stmt*& slot, const char* sql) {
+        if (!slot && sqlite3_prepare_v2(db, forTable(sql).c_str(), -1, &slot, nullptr) != SQLITE_OK) {
+            slot = nullptr;
+            throw runtime_error("Failed to prepare statement: " + string(sqlite3_errmsg(db)));
+        }
+        return slot;
+    }
+
+    // Text is bound with SQLITE_STATIC: the task outlives the step that reads it.
+    void bindText(sqlite3_stmt* stmt, int index, const string& value) {
+        sqlite3_bind_text(stmt, index, value.c_str(), static_cast<int>(value.size()), SQLITE_STATIC);
+    }
+
+    static const int COLUMN_COUNT = 8;
+
+    // Binds the task columns in the order used by the insert statement,
+    // starting at parameter first + 1 (multi-row inserts bind several tasks).
+    void bindTask(sqlite3_stmt* stmt, const Task& task, int first = 0) {
+        bindText(stmt, first + 1, task.id);
+        bindText(stmt, first + 2, task.description);
+        string deadline = task.deadlineDetails();
+        sqlite3_bind_text(stmt, first + 3, deadline.c_str(), static_cast<int>(deadline.size()), SQLITE_TRANSIENT);
+        sqlite3_bind_int64(stmt, first + 4, task.sequence);
+        bindText(stmt, first + 5, task.category());
+        sqlite3_bind_text(stmt, first + 6, statusName(task.status), -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, first + 7, task.remainingHours);
+        sqlite3_bind_int64(stmt, first + 8, task.dueAt);
+    }
+
+    static bool sameRow(const Task& a, const Task& b) {
+        return a.description == b.description && a.deadline.years == b.deadline.years &&
+               a.deadline.months == b.deadline.months && a.deadline.days == b.deadline.days &&
+               a.sequence == b.sequence && a.categoryId == b.categoryId && a.status == b.status &&
+               a.remainingHours == b.remainingHours && a.dueAt == b.dueAt;
+    }
+
+    // Returns the cached INSERT ... VALUES statement for rows rows.
+    sqlite3_stmt* batchInsertStatement(int rows) {
+        if (batchInsertStmt && batchInsertRows == rows)
+            return batchInsertStmt;
+        sqlite3_finalize(batchInsertStmt);
+        batchInsertStmt = nullptr;
+        string sql = "INSERT INTO $table (id, description, deadlineDetails, priority, category, status, remainingHours, dueAt) VALUES ";
+        for (int r = 0; r < rows; r++)
+            sql += r ? ", (?, ?, ?, ?, ?, ?, ?, ?)" : "(?, ?, ?, ?, ?, ?, ?, ?)";
+        batchInsertRows = rows;
+        return statement(batchInsertStmt, sql.c_str());
+    }
+
+    // Runs a bound statement to completion and readies it for reuse.
+    void stepDone(sqlite3_stmt* stmt) {
+        int rc = sqlite3_step(stmt);
+        TASK_COUNT(dbStatements, 1);
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        if (rc != SQLITE_DONE)
+            throw runtime_error("SQL error: " + string(sqlite3_errmsg(db)));
+    }
+
+    void applyProfile(const StorageProfile& profile) {
+        sqlite3_busy_timeout(db, profile.busyTimeoutMs);
+        executeSQL("PRAGMA journal_mode=" + profile.journalMode + ";");
+        executeSQL("PRAGMA synchronous=" + profile.synchronous + ";");
+        executeSQL("PRAGMA cache_size=-" + to_string(profile.cacheSizeKiB) + ";");
+        executeSQL("PRAGMA mmap_size=" + to_string(profile.mmapSizeBytes) + ";");
+        executeSQL(string("PRAGMA temp_store=") + (profile.tempStoreInMemory ? "MEMORY" : "DEFAULT") + ";");
+    }
+
+    // id is indexed by its PRIMARY KEY; priority (the persisted sequence) gets
+    // its own index.
+    void createSchema() {
+        executeSQL(forTable("CREATE TABLE IF NOT EXISTS $table ("
+                   "id TEXT PRIMARY KEY NOT NULL, "
+                   "description TEXT NOT NULL, "
+                   "deadlineDetails TEXT, "
+                   "priority INTEGER NOT NULL, "
+                   "category TEXT, "
+                   "status TEXT NOT NULL, "
+                   "remainingHours INTEGER NOT NULL, "
+                   "dueAt INTEGER);"));
+        if (!hasColumn(table, "dueAt")) {
+            // Older rows get a due time counted from now.
+            executeSQL(forTable("ALTER TABLE $table ADD COLUMN dueAt INTEGER;"));
+            executeSQL(forTable("UPDATE $table SET dueAt = CAST(strftime('%s', 'now') AS INTEGER) + remainingHours * 3600;"));
+        }
+        executeSQL(forTable("CREATE INDEX IF NOT EXISTS idx_$table_priority ON $table(priority);"));
+    }
+
+    bool hasColumn(const string& table, const string& column) {
+        sqlite3_stmt* stmt;
+        string sql = "PRAGMA table_info(" + table + ");";
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+            throw runtime_error("Failed to prepare statement: " + string(sqlite3_errmsg(db)));
+        bool found = false;
+        while (!found && sqlite3_step(stmt) == SQLITE_ROW)
+            found = columnText(stmt, 1) == column;
+        sqlite3_finalize(stmt);
+        return found;
+    }
+
+    // Appends a task per row of stmt, which selects TASK_COLUMNS. Rows written
+    // without dueAt (e.g. by older builds) are treated as created now.
+    // Returns the final step result.
+    static int readTasks(sqlite3_stmt* stmt, vector<Task>& tasks) {
+        long long now = time(nullptr);
+        int rc;
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            long remainingHours = sqlite3_column_int64(stmt, 6);
+            long long dueAt = sqlite3_column_type(stmt, 7) == SQLITE_NULL ? now + remainingHours * 3600LL
+                                                                         : sqlite3_column_int64(stmt, 7);
+            tasks.emplace_back(columnText(stmt, 0), columnText(stmt, 1), columnText(stmt, 4),
+                               parseStatus(columnText(stmt, 5)), remainingHours,
+                               DeadlineSpan::parse(columnText(stmt, 2), remainingHours), sqlite3_column_int64(stmt, 3),
+                               dueAt);
+        }
+        sqlite3_reset(stmt);
+        return rc;
+    }
+
+    // Resets a bound read statement and throws if it failed.
+    void finishRead(sqlite3_stmt* stmt, int rc) {
+        sqlite3_clear_bindings(stmt);
+        TASK_COUNT(dbStatements, 1);
+        if (rc != SQLITE_DONE)
+            throw runtime_error("SQL error: " + string(sqlite3_errmsg(db)));
+    }
+
+    // Steps a single-value query and returns the value.
+    long long readInteger(sqlite3_stmt* stmt) {
+        int rc = sqlite3_step(stmt);
+        long long value = rc == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : 0;
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        TASK_COUNT(dbStatements, 1);
+        if (rc != SQLITE_ROW)
+            throw runtime_error("SQL error: " + string(sqlite3_errmsg(db)));
+        return value;
+    }
+
+    static string columnText(sqlite3_stmt* stmt, int column) {
+        const unsigned char* text = sqlite3_column_text(stmt, column);
+        return text ? reinterpret_cast<const char*>(text) : "";
+    }
+
 public:
-    // Opens the SQLite database.
-    static sqlite3* openDatabase() {
-        sqlite3* db;
-        if (sqlite3_open("database.db", &db) != SQLITE_OK) {
-            throw runtime_error("Can't open database: " + string(sqlite3_errmsg(db)));
+    // Opens the SQLite database, applies the profile and creates the schema
+    // if it is missing. Tasks live in tableName (letters, digits and '_'), so
+    // several managers can keep separate task lists in one database file.
+    explicit DBManager(const string& path = "database.db", const StorageProfile& profile = StorageProfile(),
+                       const string& tableName = "data")
+        : db(nullptr), insertStmt(nullptr), updateStmt(nullptr), deleteStmt(nullptr), selectStmt(nullptr), upsertStmt(nullptr), countStmt(nullptr),
+          batchInsertStmt(nullptr), batchInsertRows(0), findStmt(nullptr), incompleteStmt(nullptr),
+          completePageStmt(nullptr), completeCountStmt(nullptr), completeBeforeStmt(nullptr), maxSequenceStmt(nullptr),
+          table(tableName) {
+        if (table.empty() || isdigit(static_cast<unsigned char>(table[0])) ||
+            !all_of(table.begin(), table.end(), [](char c) { return isalnum(static_cast<unsigned char>(c)) || c == '_'; }))
+            throw runtime_error("Invalid table name: " + table);
+        if (sqlite3_open(path.c_str(), &db) != SQLITE_OK) {
+            string error = sqlite3_errmsg(db);
+            sqlite3_close(db);
+            throw runtime_error("Can't open database: " + error);
+        }
+        try {
+            applyProfile(profile);
+            createSchema();
+        } catch (const runtime_error &) {
+            sqlite3_close(db);
+            throw;
         }
-        return db;
     }
 
-    // Closes the SQLite database.
-    static void closeDatabase(sqlite3* db) {
+    DBManager(const DBManager&) = delete;
+    DBManager& operator=(const DBManager&) = delete;
+
+    // Finalizes the cached statements and closes the database.
+    ~DBManager() {
+        sqlite3_finalize(insertStmt);
+        sqlite3_finalize(updateStmt);
+        sqlite3_finalize(deleteStmt);
+        sqlite3_finalize(selectStmt);
+        sqlite3_finalize(upsertStmt);
+        sqlite3_finalize(countStmt);
+        sqlite3_finalize(batchInsertStmt);
+        for (sqlite3_stmt* stmt : {findStmt, incompleteStmt, completePageStmt, completeCountStmt, completeBeforeStmt,
+                                   maxSequenceStmt})
+            sqlite3_finalize(stmt);
         sqlite3_close(db);
     }
 
     // Executes an SQL statement.
-    static void executeSQL(sqlite3* db, const string &sql) {
+    void executeSQL(const string &sql) {
+        TASK_COUNT(dbStatements, 1);
         char *errMsg = nullptr;
         if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &errMsg) != SQLITE_OK) {
-            string error = errMsg;
+            string error = errMsg ? errMsg : sqlite3_errmsg(db);
             sqlite3_free(errMsg);
             throw runtime_error("SQL error: " + error);
         }
     }
 
+    // Groups writes into one BEGIN IMMEDIATE ... COMMIT so they share a single
+    // journal sync. Rolls back if destroyed before commit().
+    class Transaction {
+    private:
+        DBManager& manager;
+        bool finished;
+
+    public:
+        explicit Transaction(DBManager& m) : manager(m), finished(false) {
+            manager.executeSQL("BEGIN IMMEDIATE;");
+        }
+
+        Transaction(const Transaction&) = delete;
+        Transaction& operator=(const Transaction&) = delete;
+
+        void commit() {
+            manager.executeSQL("COMMIT;");
+            finished = true;
+            TASK_COUNT(dbTransactions, 1);
+        }
+
+        ~Transaction() {
+            if (!finished) {
+                sqlite3_exec(manager.db, "ROLLBACK;", nullptr, nullptr, nullptr);
+                TASK_COUNT(dbRollbacks, 1);
+            }
+        }
+    };
+
+    // The priority column persists Task::sequence. Display priority is derived
+    // from tree position, so inserting one task writes exactly one row.
+
     // Inserts a Task into the database.
-    static void insertTask(const Task &task) {
-        sqlite3* db = openDatabase();
-        string sql = "INSERT INTO data (id, description, deadlineDetails, priority, category, status, remainingHours) VALUES ('" +
-                     task.id + "', '" + task.description + "', '" + task.deadlineDetails + "', " + to_string(task.priority) + ", '" +
-                     task.category + "', '" + task.status + "', " + to_string(task.remainingHours) + ");";
-        executeSQL(db, sql);
-        closeDatabase(db);
+    void insertTask(const Task &task) {
+        sqlite3_stmt* stmt = statement(insertStmt,
+            "INSERT INTO $table (id, description, deadlineDetails, priority, category, status, remainingHours, dueAt) "
+            "VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8);");
+        bindTask(stmt, task);
+        stepDone(stmt);
     }
 
     // Updates a Task in the database.
-    static void updateTask(const Task &task) {
-        sqlite3* db = openDatabase();
-        string sql = "UPDATE data SET description='" + task.description + "', deadlineDetails='" + task.deadlineDetails +
-                     "', priority=" + to_string(task.priority) + ", category='" + task.category +
-                     "', status='" + task.status + "', remainingHours=" + to_string(task.remainingHours) +
-                     " WHERE id='" + task.id + "';";
-        executeSQL(db, sql);
-        closeDatabase(db);
+    void updateTask(const Task &task) {
+        sqlite3_stmt* stmt = statement(updateStmt,
+            "UPDATE $table SET description=?2, deadlineDetails=?3, priority=?4, category=?5, status=?6, remainingHours=?7, "
+            "dueAt=?8 WHERE id=?1;");
+        bindTask(stmt, task);
+        stepDone(stmt);
+    }
+
+    // Inserts the task, or updates its row if the ID already exists.
+    void upsertTask(const Task &task) {
+        sqlite3_stmt* stmt = statement(upsertStmt,
+            "INSERT INTO $table (id, description, deadlineDetails, priority, category, status, remainingHours, dueAt) "
+            "VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8) "
+            "ON CONFLICT(id) DO UPDATE SET description=excluded.description, deadlineDetails=excluded.deadlineDetails, "
+            "priority=excluded.priority, category=excluded.category, status=excluded.status, "
+            "remainingHours=excluded.remainingHours, dueAt=excluded.dueAt;");
+        bindTask(stmt, task);
+        stepDone(stmt);
     }
 
     // Deletes a Task from the database.
-    static void deleteTask(const string &id) {
-        sqlite3* db = openDatabase();
-        string sql = "DELETE FROM data WHERE id='" + id + "';";
-        executeSQL(db, sql);
-        closeDatabase(db);
+    void deleteTask(const string &id) {
+        sqlite3_stmt* stmt = statement(deleteStmt, "DELETE FROM $table WHERE id=?1;");
+        bindText(stmt, 1, id);
+        stepDone(stmt);
     }
 
-    // Loads all tasks from the database.
-    static vector<Task> loadTasks() {
+    // Loads all tasks from the database. Rows are moved straight into a vector
+    // sized up front. They come back in table order: a plain scan plus the
+    // key sort in AVLTree::rebuild is several times faster than ORDER BY.
+    vector<Task> loadTasks() override {
+        TASK_TIME(dbLoadTasks);
         vector<Task> tasks;
-        sqlite3* db = openDatabase();
-        string sql = "SELECT id, description, deadlineDetails, priority, category, status, remainingHours FROM data;";
-        sqlite3_stmt *stmt;
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, 0) != SQLITE_OK) {
-            closeDatabase(db);
-            throw runtime_error("Failed to prepare statement.");
-        }
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-            string id = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
-            string description = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
-            string deadlineDetails = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
-            int priority = sqlite3_column_int(stmt, 3);
-            string category = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 4));
-            string status = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 5));
-            long remainingHours = sqlite3_column_int64(stmt, 6);
-            tasks.push_back(Task(id, description, priority, category, status, remainingHours, deadlineDetails));
-        }
-        sqlite3_finalize(stmt);
-        closeDatabase(db);
+        sqlite3_stmt* stmt = statement(countStmt, "SELECT COUNT(*) FROM $table;");
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+            tasks.reserve(static_cast<size_t>(sqlite3_column_int64(stmt, 0)));
+        sqlite3_reset(stmt);
+
+        stmt = statement(selectStmt, "SELECT " TASK_COLUMNS " FROM $table;");
+        int rc = readTasks(stmt, tasks);
+        TASK_COUNT(dbStatements, 2);
+        if (rc != SQLITE_DONE)
+            throw runtime_error("SQL error: " + string(sqlite3_errmsg(db)));
+        TASK_COUNT(dbRowsLoaded, tasks.size());
         return tasks;
     }
 
-    // Rebuilds the database table to match the current tasks.
-    static void rebuildTasks(const vector<Task> &tasks) {
-        sqlite3* db = openDatabase();
-        string sql = "DELETE FROM data;";
-        executeSQL(db, sql);
+    // The queries below serve TaskStore's hot-set mode, where complete tasks
+    // stay here until needed. They expect the index ensureStatusIndex() adds.
+    void ensureStatusIndex() {
+        executeSQL(forTable("CREATE INDEX IF NOT EXISTS idx_$table_status ON $table(status, remainingHours, priority);"));
+    }
+
+    optional<Task> findTask(const string &id) {
+        sqlite3_stmt* stmt = statement(findStmt, "SELECT " TASK_COLUMNS " FROM $table WHERE id=?1;");
+        bindText(stmt, 1, id);
+        vector<Task> tasks;
+        finishRead(stmt, readTasks(stmt, tasks));
+        if (tasks.empty())
+            return nullopt;
+        return std::move(tasks[0]);
+    }
+
+    vector<Task> loadIncompleteTasks() {
+        TASK_TIME(dbLoadTasks);
+        sqlite3_stmt* stmt = statement(incompleteStmt, "SELECT " TASK_COLUMNS " FROM $table WHERE status<>'complete';");
+        vector<Task> tasks;
+        finishRead(stmt, readTasks(stmt, tasks));
+        TASK_COUNT(dbRowsLoaded, tasks.size());
+        return tasks;
+    }
+
+    // limit complete tasks in priority order, skipping the first offset.
+    vector<Task> loadCompleteTasks(int offset, int limit) {
+        sqlite3_stmt* stmt = statement(completePageStmt,
+            "SELECT " TASK_COLUMNS " FROM $table WHERE status='complete' ORDER BY remainingHours, priority "
+            "LIMIT ?2 OFFSET ?1;");
+        sqlite3_bind_int(stmt, 1, offset);
+        sqlite3_bind_int(stmt, 2, limit);
+        vector<Task> tasks;
+        finishRead(stmt, readTasks(stmt, tasks));
+        return tasks;
+    }
+
+    int countCompleteTasks() {
+        sqlite3_stmt* stmt = statement(completeCountStmt, "SELECT COUNT(*) FROM $table WHERE status='complete';");
+        return static_cast<int>(readInteger(stmt));
+    }
+
+    // Complete tasks ordered before one with this remainingHours and sequence.
+    int countCompleteBefore(long remainingHours, long long sequence) {
+        sqlite3_stmt* stmt = statement(completeBeforeStmt,
+            "SELECT COUNT(*) FROM $table WHERE status='complete' AND "
+            "(remainingHours<?1 OR (remainingHours=?1 AND priority<?2));");
+        sqlite3_bind_int64(stmt, 1, remainingHours);
+        sqlite3_bind_int64(stmt, 2, sequence);
+        return static_cast<int>(readInteger(stmt));
+    }
+
+    long long maxSequence() {
+        sqlite3_stmt* stmt = statement(maxSequenceStmt, "SELECT COALESCE(MAX(priority), 0) FROM $table;");
+        return readInteger(stmt);
+    }
+
+    // Applies a ChangeSet (upserts and deletes) in a single transaction.
+    void writeChanges(const ChangeSet &changes) override {
+        TASK_TIME(dbWriteChanges);
+        Transaction transaction(*this);
+        for (const auto &change : changes) {
+            if (change.second)
+                upsertTask(*change.second);
+            else
+                deleteTask(change.first);
+        }
+        transaction.commit();
+        TASK_COUNT(dbRowsWritten, changes.size());
+    }
+
+    // Inserts tasks using rowsPerStatement-row VALUES lists, falling back to
+    // the single-row statement for the remainder. Call inside a Transaction.
+    void insertTasks(const vector<Task> &tasks, int rowsPerStatement = 1) {
+        size_t next = 0;
+        if (rowsPerStatement > 1) {
+            for (; next + rowsPerStatement <= tasks.size(); next += rowsPerStatement) {
+                sqlite3_stmt* stmt = batchInsertStatement(rowsPerStatement);
+                for (int r = 0; r < rowsPerStatement; r++)
+                    bindTask(stmt, tasks[next + r], r * COLUMN_COUNT);
+                stepDone(stmt);
+            }
+        }
+        for (; next < tasks.size(); next++)
+            insertTask(tasks[next]);
+    }
+
+    // Rebuilds the database table to match the current tasks in a single
+    // transaction. Only rows that are new, changed or gone are written.
+    // Returns the number of rows written.
+    size_t rebuildTasks(const vector<Task> &tasks, int rowsPerStatement = 64) {
+        TASK_TIME(dbRebuildTasks);
+        Transaction transaction(*this);
+        unordered_map<string, Task> stored;
+        for (auto &task : loadTasks())
+            stored.emplace(task.id, std::move(task));
+
+        vector<Task> added;
+        size_t written = 0;
         for (const auto &task : tasks) {
-            sql = "INSERT INTO data (id, description, deadlineDetails, priority, category, status, remainingHours) VALUES ('" +
-                  task.id + "', '" + task.description + "', '" + task.deadlineDetails + "', " + to_string(task.priority) + ", '" +
-                  task.category + "', '" + task.status + "', " + to_string(task.remainingHours) + ");";
-            executeSQL(db, sql);
+            auto it = stored.find(task.id);
+            if (it == stored.end()) {
+                added.push_back(task);
+                continue;
+            }
+            if (!sameRow(it->second, task)) {
+                updateTask(task);
+                written++;
+            }
+            stored.erase(it);
+        }
+        for (const auto &entry : stored) {
+            deleteTask(entry.first);
+            written++;
+        }
+        insertTasks(added, rowsPerStatement);
+        written += added.size();
+        transaction.commit();
+        TASK_COUNT(dbRowsWritten, written);
+        return written;
+    }
+};
+
+// Fires overdue events from the tree's due-time index. Each sweep reports the
+// incomplete tasks whose due time passed since the previous sweep, so a task
+// is reported once however often sweep() runs, in O(log n) plus one step per
+// reported task. Tasks due before the scheduler was created are not
+// reported; list them with AVLTree::forEachDue.
+class DeadlineScheduler {
+private:
+    const AVLTree& tree;
+    long long sweptUntil;
+
+public:
+    DeadlineScheduler(const AVLTree& t, long long now) : tree(t), sweptUntil(now) {}
+
+    template <typename Callback>
+    size_t sweep(long long now, Callback onOverdue) {
+        if (now <= sweptUntil)
+            return 0;
+        size_t fired = tree.forEachDue(sweptUntil + 1, now, onOverdue);
+        sweptUntil = now;
+        return fired;
+    }
+};
+
+// Write-behind queue between the tree and its TaskStorage. Mutations only
+// record the latest state of each task (or a tombstone) in memory; a
+// background thread writes the coalesced changes in one transaction every
+// interval, or sooner once maxPending tasks are dirty. Repeated edits to a
+// task become one write. While attached, the storage must only be used
+// through the journal.
+class WriteBehindJournal : public TaskJournal {
+private:
+    TaskStorage& storage;
+    chrono::milliseconds interval;
+    size_t maxPending;
+
+    mutex pendingMutex;
+    condition_variable wakeUp;
+    ChangeSet pending;
+    bool stopping;
+
+    // One writer at a time: flusher thread or flush(). Each takes it before
+    // taking pending and holds it through the write, so batches commit in
+    // the order they were taken and flush() returns only once everything
+    // recorded before it, including a batch the flusher was writing, is
+    // committed. Lock order: writeMutex, then pendingMutex.
+    mutex writeMutex;
+    thread flusher;
+
+    // Writes everything pending; on failure puts back the changes not
+    // superseded since.
+    void writePending() {
+        lock_guard<mutex> writeLock(writeMutex);
+        ChangeSet batch;
+        {
+            lock_guard<mutex> lock(pendingMutex);
+            batch.swap(pending);
+        }
+        if (batch.empty())
+            return;
+        try {
+            storage.writeChanges(batch);
+        } catch (const runtime_error &) {
+            lock_guard<mutex> lock(pendingMutex);
+            for (auto &change : batch)
+                pending.emplace(change.first, std::move(change.second));
+            throw;
         }
-        closeDatabase(db);
+    }
+
+    void run() {
+        unique_lock<mutex> lock(pendingMutex);
+        while (!stopping) {
+            wakeUp.wait_for(lock, interval, [this] { return stopping || pending.size() >= maxPending; });
+            if (pending.empty())
+                continue;
+            lock.unlock();
+            try {
+                writePending();
+            } catch (const runtime_error &) {
+                // Kept in pending; retried next interval or by flush().
+            }
+            lock.lock();
+        }
+    }
+
+    void record(const string& id, optional<Task> state) {
+        lock_guard<mutex> lock(pendingMutex);
+        pending.insert_or_assign(id, std::move(state));
+        if (pending.size() >= maxPending)
+            wakeUp.notify_one();
+    }
+
+    void stopFlusher() {
+        {
+            lock_guard<mutex> lock(pendingMutex);
+            stopping = true;
+        }
+        wakeUp.notify_one();
+        if (flusher.joinable())
+            flusher.join();
+    }
+
+public:
+    explicit WriteBehindJournal(TaskStorage& target, chrono::milliseconds flushInterval = chrono::milliseconds(500),
+                                size_t maxPendingTasks = 1000)
+        : storage(target), interval(flushInterval), maxPending(maxPendingTasks), stopping(false),
+          flusher(&WriteBehindJournal::run, this) {}
+
+    WriteBehindJournal(const WriteBehindJournal&) = delete;
+    WriteBehindJournal& operator=(const WriteBehindJournal&) = delete;
+
+    // Last resort after close(): a failed final write can only be reported,
+    // and the changes it held are lost.
+    ~WriteBehindJournal() {
+        stopFlusher();
+        try {
+            flush();
+        } catch (const runtime_error &e) {
+            cerr << "Database error: " << e.what() << " (" << pendingCount() << " unsaved change(s) lost)\n";
+        }
+    }
+
+    void recordUpsert(const Task& task) override {
+        record(task.id, task);
+    }
+
+    void recordDelete(const string& id) override {
+        record(id, nullopt);
+    }
+
+    // Synchronously writes all pending changes, after waiting for a batch
+    // the flusher is writing; throws if the write fails.
+    void flush() {
+        writePending();
+    }
+
+    // Stops the flusher thread and writes whatever is still pending; throws
+    // if that write fails, keeping the changes pending so flush() can retry.
+    // Call before destruction, which cannot throw.
+    void close() {
+        stopFlusher();
+        flush();
+    }
+
+    size_t pendingCount() {
+        lock_guard<mutex> lock(pendingMutex);
+        return pending.size();
     }
 };
 
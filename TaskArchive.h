@@ -0,0 +1,156 @@
+#ifndef TASK_ARCHIVE_H
+#define TASK_ARCHIVE_H
+
+#include "TaskStore.h"
+#include <condition_variable>
+#include <thread>
+
+// Tuning for TaskArchiver. Each step scans at most scanLimit complete tasks
+// and archives at most batchSize of them, so the write lock is held briefly
+// however many tasks are waiting.
+struct ArchiveProfile {
+    long long minAgeSeconds = 30LL * 24 * 3600;
+    size_t batchSize = 256;
+    size_t scanLimit = 4096;
+    chrono::milliseconds interval = chrono::milliseconds(1000);
+};
+
+// Moves old complete tasks out of a TaskStore into a cold DBManager table,
+// where they can still be looked up and listed but take no part in the
+// tree, its indexes or priorities. The tree does not record when a task was
+// completed, so a complete task is old once its due time is minAgeSeconds
+// in the past. A background thread runs one step per interval; each step
+// resumes the scan of complete tasks where the previous one stopped, copies
+// the old ones to the archive in one transaction, then deletes them from the
+// store (the store's journal removes them from its storage). A task changed
+// in between stays in the store and its archived copy is removed again.
+// Archived rows are keyed by task ID, and a new task may reuse the ID of an
+// archived one: such a task is not archived and stays in the store, so the
+// earlier archived copy is never written over or removed. The archive
+// connection is used only by this class.
+class TaskArchiver {
+private:
+    TaskStore& store;
+    DBManager& archive;
+    ArchiveProfile profile;
+    OrderKey resume; // scan position among the complete tasks
+
+    mutable mutex archiveMutex; // guards archive and resume
+    mutex stopMutex;
+    condition_variable wakeUp;
+    bool stopping;
+    thread worker;
+
+    static OrderKey firstComplete() { return OrderKey{1, LONG_MIN, LLONG_MIN}; }
+
+    void run() {
+        unique_lock<mutex> lock(stopMutex);
+        while (!stopping) {
+            wakeUp.wait_for(lock, profile.interval, [this] { return stopping; });
+            if (stopping)
+                break;
+            lock.unlock();
+            try {
+                // Keep stepping while whole batches are found.
+                while (step(time(nullptr)) == profile.batchSize && !stopRequested()) {
+                }
+            } catch (const runtime_error &) {
+                // Nothing was deleted from the store; retried next interval.
+            }
+            lock.lock();
+        }
+    }
+
+    bool stopRequested() {
+        lock_guard<mutex> lock(stopMutex);
+        return stopping;
+    }
+
+public:
+    TaskArchiver(TaskStore& s, DBManager& db, ArchiveProfile p = ArchiveProfile(), bool background = true)
+        : store(s), archive(db), profile(p), resume(firstComplete()), stopping(false) {
+        profile.batchSize = max<size_t>(profile.batchSize, 1);
+        profile.scanLimit = max(profile.scanLimit, profile.batchSize);
+        archive.ensureStatusIndex();
+        if (background)
+            worker = thread(&TaskArchiver::run, this);
+    }
+
+    TaskArchiver(const TaskArchiver&) = delete;
+    TaskArchiver& operator=(const TaskArchiver&) = delete;
+
+    ~TaskArchiver() {
+        {
+            lock_guard<mutex> lock(stopMutex);
+            stopping = true;
+        }
+        wakeUp.notify_one();
+        if (worker.joinable())
+            worker.join();
+    }
+
+    // One incremental step; returns the number of tasks archived. Safe to
+    // call next to the background thread.
+    size_t step(long long now) {
+        TASK_TIME(archiveStep);
+        lock_guard<mutex> lock(archiveMutex);
+        long long cutoff = now - profile.minAgeSeconds;
+        vector<Task> old;
+        OrderKey next = firstComplete();
+        store.read([&](const AVLTree &tree) {
+            size_t scanned = 0;
+            auto it = tree.lowerBound(resume);
+            for (; it != tree.end() && scanned < profile.scanLimit && old.size() < profile.batchSize; ++it, ++scanned) {
+                if (it->dueAt <= cutoff)
+                    old.push_back(*it);
+            }
+            // Past the last complete task, the next step starts over.
+            if (it != tree.end())
+                next = tree.keyOf(*it);
+        });
+        resume = next;
+        // IDs already archived belong to earlier tasks; keep those rows.
+        old.erase(remove_if(old.begin(), old.end(),
+                            [this](const Task& task) { return archive.findTask(task.id).has_value(); }),
+                  old.end());
+        if (old.empty())
+            return 0;
+
+        ChangeSet copies;
+        for (const auto &task : old)
+            copies.emplace(task.id, task);
+        archive.writeChanges(copies);
+
+        vector<string> moved = store.deleteUnchanged(old);
+        if (moved.size() < old.size()) {
+            ChangeSet stale;
+            for (const auto &task : old)
+                stale.emplace(task.id, task);
+            for (const auto &id : moved)
+                stale.erase(id);
+            for (auto &change : stale)
+                change.second = nullopt;
+            archive.writeChanges(stale);
+        }
+        TASK_COUNT(tasksArchived, moved.size());
+        return moved.size();
+    }
+
+    optional<Task> find(const string& id) const {
+        lock_guard<mutex> lock(archiveMutex);
+        return archive.findTask(id);
+    }
+
+    int size() const {
+        lock_guard<mutex> lock(archiveMutex);
+        return archive.countCompleteTasks();
+    }
+
+    // limit archived tasks by remaining hours, skipping the first offset.
+    vector<Task> list(int offset, int limit) const {
+        lock_guard<mutex> lock(archiveMutex);
+        return archive.loadCompleteTasks(offset, limit);
+    }
+};
+
+#endif
@@ -0,0 +1,178 @@
+#ifndef TASK_EVENTS_H
+#define TASK_EVENTS_H
+
+#include "SmartTaskManager.h"
+#include <functional>
+#include <memory>
+
+// One mutation as seen by subscribers: the task's new state, or nullopt when
+// it was deleted. version counts the hub's events from 1, so a consumer can
+// tell its place in the stream. Priorities are not included: one insert
+// shifts the priority of every later task, so consumers that need them order
+// tasks by (status, remainingHours, sequence) as the tree does.
+struct TaskEvent {
+    uint64_t version;
+    string id;
+    optional<Task> task;
+};
+
+// Fixed-capacity lock-free ring for exactly one producer and one consumer
+// thread at a time. Capacity is rounded up to a power of two.
+template <typename T>
+class SpscRing {
+private:
+    vector<T> slots;
+    size_t mask;
+    alignas(64) atomic<size_t> head; // next slot to read; written by the consumer
+    alignas(64) atomic<size_t> tail; // next slot to write; written by the producer
+
+public:
+    explicit SpscRing(size_t capacity) : head(0), tail(0) {
+        size_t size = 1;
+        while (size < max<size_t>(capacity, 1))
+            size <<= 1;
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    size_t capacity() const { return slots.size(); }
+
+    // Returns false, leaving value untouched, when the ring is full.
+    bool tryPush(T&& value) {
+        size_t t = tail.load(memory_order_relaxed);
+        if (t - head.load(memory_order_acquire) == slots.size())
+            return false;
+        slots[t & mask] = std::move(value);
+        tail.store(t + 1, memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T& value) {
+        size_t h = head.load(memory_order_relaxed);
+        if (h == tail.load(memory_order_acquire))
+            return false;
+        value = std::move(slots[h & mask]);
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+};
+
+// A subscriber's buffered view of the event stream, for consumers on another
+// thread. The hub pushes without blocking; when the consumer falls behind by
+// a full ring the newer events are dropped and overflowed() reports it once,
+// after which the consumer should reread what it mirrors. notify, if set,
+// runs on the producer when an event arrives after the consumer called
+// rearm(), so a consumer can sleep until there is something to read.
+class TaskEventQueue {
+private:
+    friend class TaskEventHub;
+
+    SpscRing<TaskEvent> ring;
+    function<void()> notify;
+    atomic<bool> signalled;
+    atomic<bool> dropped;
+    int subscription;
+
+    void push(TaskEvent event) {
+        if (!ring.tryPush(std::move(event)))
+            dropped.store(true, memory_order_relaxed);
+        if (notify && !signalled.exchange(true))
+            notify();
+    }
+
+public:
+    TaskEventQueue(size_t capacity, function<void()> onEvent)
+        : ring(capacity), notify(std::move(onEvent)), signalled(false), dropped(false), subscription(-1) {}
+
+    // Call before draining: events pushed afterwards notify again.
+    void rearm() { signalled.store(false); }
+
+    bool pop(TaskEvent& event) { return ring.tryPop(event); }
+
+    bool overflowed() { return dropped.exchange(false, memory_order_relaxed); }
+};
+
+// Journal that publishes every mutation it records to its subscribers and
+// passes it on to a downstream journal (the one persisting the tree), so
+// integrations follow the tasks incrementally instead of rereading the
+// table. Callbacks run synchronously on the thread mutating the tree, under
+// its lock: they must be quick and must not touch the tree. Consumers on
+// other threads subscribe a TaskEventQueue instead. recordUpsert and
+// recordDelete must not run concurrently, which the tree's writers already
+// guarantee; subscribing and unsubscribing may happen from any thread.
+class TaskEventHub : public TaskJournal {
+public:
+    typedef function<void(const TaskEvent&)> Callback;
+
+private:
+    TaskJournal* downstream;
+    uint64_t version;
+    mutex subscribersMutex;
+    vector<pair<int, Callback>> subscribers;
+    atomic<size_t> subscriberCount;
+    int nextSubscription;
+
+    void publish(const string& id, optional<Task> task) {
+        ++version;
+        if (subscriberCount.load(memory_order_acquire) == 0)
+            return;
+        TaskEvent event{version, id, std::move(task)};
+        lock_guard<mutex> lock(subscribersMutex);
+        for (const auto &subscriber : subscribers)
+            subscriber.second(event);
+    }
+
+public:
+    explicit TaskEventHub(TaskJournal* next = nullptr)
+        : downstream(next), version(0), subscriberCount(0), nextSubscription(0) {}
+
+    TaskEventHub(const TaskEventHub&) = delete;
+    TaskEventHub& operator=(const TaskEventHub&) = delete;
+
+    // Set before the hub is attached to a tree.
+    void setDownstream(TaskJournal* next) { downstream = next; }
+
+    void recordUpsert(const Task& task) override {
+        if (downstream)
+            downstream->recordUpsert(task);
+        publish(task.id, task);
+    }
+
+    void recordDelete(const string& id) override {
+        if (downstream)
+            downstream->recordDelete(id);
+        publish(id, nullopt);
+    }
+
+    // Returns an ID for unsubscribe().
+    int subscribe(Callback callback) {
+        lock_guard<mutex> lock(subscribersMutex);
+        int id = nextSubscription++;
+        subscribers.emplace_back(id, std::move(callback));
+        subscriberCount = subscribers.size();
+        return id;
+    }
+
+    // After this returns the callback is not running and will not run again.
+    void unsubscribe(int id) {
+        lock_guard<mutex> lock(subscribersMutex);
+        subscribers.erase(remove_if(subscribers.begin(), subscribers.end(),
+                                    [id](const pair<int, Callback>& s) { return s.first == id; }),
+                          subscribers.end());
+        subscriberCount = subscribers.size();
+    }
+
+    shared_ptr<TaskEventQueue> subscribeQueue(size_t capacity, function<void()> notify = nullptr) {
+        shared_ptr<TaskEventQueue> queue = make_shared<TaskEventQueue>(capacity, std::move(notify));
+        TaskEventQueue* q = queue.get();
+        queue->subscription = subscribe([q](const TaskEvent& event) { q->push(event); });
+        return queue;
+    }
+
+    void unsubscribe(const shared_ptr<TaskEventQueue>& queue) { unsubscribe(queue->subscription); }
+};
+
+#endif
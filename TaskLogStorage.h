@@ -0,0 +1,549 @@
+#ifndef TASK_LOG_STORAGE_H
+#define TASK_LOG_STORAGE_H
+
+#include "SmartTaskManager.h"
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Tuning for LogStorage. The log is folded into a new snapshot once it holds
+// at least compactMinChanges changes and compactRatio times as many as the
+// snapshot has tasks, which keeps compaction amortized O(1) per change.
+struct LogProfile {
+    bool syncWrites = true; // fdatasync every append, so an acknowledged write survives power loss
+    size_t compactMinChanges = 10000;
+    double compactRatio = 0.5;
+};
+
+// TaskStorage kept in two files instead of SQLite:
+//   <base>.snap  versioned binary snapshot: a header, fixed-size task records,
+//                a category table and one blob of string bytes. Loading maps
+//                the file and builds each task straight from its record.
+//   <base>.log   append-only operation log. Each writeChanges appends one
+//                checksummed batch, so a crash mid-append loses only that
+//                batch: replay stops at the first torn batch and cuts it off.
+// Startup reads the snapshot and replays the log, and a write costs one
+// append the size of the change, not of the table. Compaction writes the
+// combined state to a new snapshot, renames it into place, then empties the
+// log; replaying a log the snapshot already includes gives the same tasks,
+// so a crash between those steps is harmless. Not thread-safe, like DBManager.
+// One LogStorage at a time may hold a base path: it keeps an exclusive lock
+// on the log, and opening a second one, from this process or another, throws.
+class LogStorage : public TaskStorage {
+private:
+    static const uint32_t SNAPSHOT_VERSION = 1;
+    static const uint32_t LOG_VERSION = 1;
+    static const uint32_t BYTE_ORDER_MARK = 0x01020304; // files are native-endian
+    static constexpr char SNAPSHOT_MAGIC[8] = {'T', 'A', 'S', 'K', 'S', 'N', 'A', 'P'};
+    static constexpr char LOG_MAGIC[8] = {'T', 'A', 'S', 'K', 'L', 'O', 'G', '\0'};
+
+    struct SnapshotHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t byteOrder;
+        uint64_t taskCount;
+        uint64_t categoryCount;
+        uint64_t stringBytes;
+    };
+
+    // A task's id and description are adjacent in the string blob.
+    struct SnapshotRecord {
+        int64_t sequence;
+        int64_t dueAt;
+        int64_t remainingHours;
+        uint64_t textOffset;
+        uint32_t idLength;
+        uint32_t descriptionLength;
+        int32_t years;
+        int32_t months;
+        int32_t days;
+        uint32_t category; // index into the snapshot's category table
+        uint8_t status;
+        uint8_t padding[7];
+    };
+
+    struct SnapshotCategory {
+        uint64_t offset;
+        uint32_t length;
+        uint32_t padding;
+    };
+
+    struct LogHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t byteOrder;
+    };
+
+    // Each batch is a BatchHeader, then a change count and the changes: a
+    // kind byte and the id, plus for upserts the remaining task fields.
+    struct BatchHeader {
+        uint32_t payloadBytes;
+        uint32_t checksum; // FNV-1a of the payload
+    };
+
+    enum ChangeKind : uint8_t { DeleteChange, UpsertChange };
+
+    // Read-only mapping of a whole file; empty if the file does not exist.
+    class MappedFile {
+    public:
+        const char* data;
+        size_t size;
+
+        explicit MappedFile(const string& path) : data(nullptr), size(0) {
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                if (errno == ENOENT)
+                    return;
+                fail("Can't open", path);
+            }
+            struct stat info;
+            if (fstat(fd, &info) != 0) {
+                close(fd);
+                fail("Can't stat", path);
+            }
+            size = static_cast<size_t>(info.st_size);
+            if (size > 0) {
+                void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (map == MAP_FAILED) {
+                    close(fd);
+                    fail("Can't map", path);
+                }
+                madvise(map, size, MADV_SEQUENTIAL);
+                data = static_cast<const char*>(map);
+            }
+            close(fd);
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        ~MappedFile() {
+            if (data)
+                munmap(const_cast<char*>(data), size);
+        }
+    };
+
+    // Bounds-checked reads from a log batch; throws on truncated input.
+    struct Reader {
+        const char* cursor;
+        const char* end;
+
+        template <typename T>
+        T read() {
+            if (static_cast<size_t>(end - cursor) < sizeof(T))
+                throw runtime_error("Storage error: truncated log batch");
+            T value;
+            memcpy(&value, cursor, sizeof(T));
+            cursor += sizeof(T);
+            return value;
+        }
+
+        string readString() {
+            uint32_t length = read<uint32_t>();
+            if (static_cast<size_t>(end - cursor) < length)
+                throw runtime_error("Storage error: truncated log batch");
+            string text(cursor, length);
+            cursor += length;
+            return text;
+        }
+    };
+
+    string snapshotPath;
+    string logPath;
+    LogProfile profile;
+    int logFd;
+    uint64_t logBytes;      // end of the last complete batch
+    size_t logChanges;      // changes in the log since the snapshot
+    size_t snapshotTasks;
+    bool hadData;
+
+    [[noreturn]] static void fail(const string& what, const string& path) {
+        throw runtime_error("Storage error: " + what + " " + path + ": " + strerror(errno));
+    }
+
+    static uint32_t checksum(const char* data, size_t size) {
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < size; i++) {
+            hash ^= static_cast<unsigned char>(data[i]);
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+
+    template <typename T>
+    static void put(string& out, const T& value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    static void putString(string& out, const string& text) {
+        put(out, static_cast<uint32_t>(text.size()));
+        out += text;
+    }
+
+    static void writeAll(int fd, const char* data, size_t size, off_t offset, const string& path) {
+        while (size > 0) {
+            ssize_t written = pwrite(fd, data, size, offset);
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                fail("Can't write", path);
+            }
+            data += written;
+            size -= static_cast<size_t>(written);
+            offset += written;
+        }
+    }
+
+    static string directoryOf(const string& path) {
+        size_t slash = path.rfind('/');
+        if (slash == string::npos)
+            return ".";
+        return slash == 0 ? "/" : path.substr(0, slash);
+    }
+
+    // Makes a completed rename durable.
+    static void syncDirectory(const string& path) {
+        string directory = directoryOf(path);
+        int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0)
+            fail("Can't open", directory);
+        int rc = fsync(fd);
+        close(fd);
+        if (rc != 0)
+            fail("Can't sync", directory);
+    }
+
+    vector<Task> readSnapshot() {
+        MappedFile file(snapshotPath);
+        vector<Task> tasks;
+        if (!file.data)
+            return tasks;
+        auto corrupt = [&]() { return runtime_error("Storage error: corrupt snapshot " + snapshotPath); };
+        SnapshotHeader header;
+        if (file.size < sizeof(header))
+            throw corrupt();
+        memcpy(&header, file.data, sizeof(header));
+        if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.byteOrder != BYTE_ORDER_MARK)
+            throw corrupt();
+        if (header.version != SNAPSHOT_VERSION)
+            throw runtime_error("Storage error: unsupported snapshot version " + to_string(header.version));
+        size_t body = file.size - sizeof(header);
+        if (header.taskCount > body / sizeof(SnapshotRecord) ||
+            header.categoryCount > (body - header.taskCount * sizeof(SnapshotRecord)) / sizeof(SnapshotCategory) ||
+            header.stringBytes != body - header.taskCount * sizeof(SnapshotRecord) -
+                                      header.categoryCount * sizeof(SnapshotCategory))
+            throw corrupt();
+
+        // The header is a multiple of 8 bytes and the mapping page-aligned,
+        // so the records can be read in place.
+        const SnapshotRecord* records = reinterpret_cast<const SnapshotRecord*>(file.data + sizeof(header));
+        const SnapshotCategory* categoryTable =
+            reinterpret_cast<const SnapshotCategory*>(records + header.taskCount);
+        const char* strings = reinterpret_cast<const char*>(categoryTable + header.categoryCount);
+        auto inStrings = [&](uint64_t offset, uint64_t length) {
+            return offset <= header.stringBytes && length <= header.stringBytes - offset;
+        };
+
+        vector<string> categories;
+        categories.reserve(header.categoryCount);
+        for (uint64_t c = 0; c < header.categoryCount; c++) {
+            if (!inStrings(categoryTable[c].offset, categoryTable[c].length))
+                throw corrupt();
+            categories.emplace_back(strings + categoryTable[c].offset, categoryTable[c].length);
+        }
+        tasks.reserve(header.taskCount);
+        for (uint64_t i = 0; i < header.taskCount; i++) {
+            const SnapshotRecord& r = records[i];
+            if (r.category >= header.categoryCount || r.status > 1 ||
+                !inStrings(r.textOffset, uint64_t(r.idLength) + r.descriptionLength))
+                throw corrupt();
+            const char* text = strings + r.textOffset;
+            tasks.emplace_back(string(text, r.idLength), string(text + r.idLength, r.descriptionLength),
+                               categories[r.category], static_cast<TaskStatus>(r.status), r.remainingHours,
+                               DeadlineSpan{r.years, r.months, r.days}, r.sequence, r.dueAt);
+        }
+        return tasks;
+    }
+
+    // Writes tasks to a temporary file and renames it over the snapshot.
+    void writeSnapshot(const vector<Task>& tasks) {
+        vector<SnapshotRecord> records;
+        records.reserve(tasks.size());
+        vector<SnapshotCategory> categoryTable;
+        unordered_map<uint32_t, uint32_t> localCategory; // CategoryDictionary ID -> table index
+        string strings;
+        for (const Task& task : tasks) {
+            auto inserted = localCategory.emplace(task.categoryId, static_cast<uint32_t>(categoryTable.size()));
+            if (inserted.second) {
+                const string& name = task.category();
+                categoryTable.push_back(SnapshotCategory{strings.size(), static_cast<uint32_t>(name.size()), 0});
+                strings += name;
+            }
+            SnapshotRecord r = {};
+            r.sequence = task.sequence;
+            r.dueAt = task.dueAt;
+            r.remainingHours = task.remainingHours;
+            r.textOffset = strings.size();
+            r.idLength = static_cast<uint32_t>(task.id.size());
+            r.descriptionLength = static_cast<uint32_t>(task.description.size());
+            r.years = task.deadline.years;
+            r.months = task.deadline.months;
+            r.days = task.deadline.days;
+            r.category = inserted.first->second;
+            r.status = static_cast<uint8_t>(task.status);
+            records.push_back(r);
+            strings += task.id;
+            strings += task.description;
+        }
+        SnapshotHeader header = {};
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.version = SNAPSHOT_VERSION;
+        header.byteOrder = BYTE_ORDER_MARK;
+        header.taskCount = records.size();
+        header.categoryCount = categoryTable.size();
+        header.stringBytes = strings.size();
+
+        string temporary = snapshotPath + ".tmp";
+        int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            fail("Can't create", temporary);
+        try {
+            off_t offset = 0;
+            auto append = [&](const void* data, size_t size) {
+                writeAll(fd, static_cast<const char*>(data), size, offset, temporary);
+                offset += static_cast<off_t>(size);
+            };
+            append(&header, sizeof(header));
+            append(records.data(), records.size() * sizeof(SnapshotRecord));
+            append(categoryTable.data(), categoryTable.size() * sizeof(SnapshotCategory));
+            append(strings.data(), strings.size());
+            if (fsync(fd) != 0)
+                fail("Can't sync", temporary);
+        } catch (const runtime_error &) {
+            close(fd);
+            unlink(temporary.c_str());
+            throw;
+        }
+        close(fd);
+        if (rename(temporary.c_str(), snapshotPath.c_str()) != 0)
+            fail("Can't rename", temporary);
+        syncDirectory(snapshotPath);
+        snapshotTasks = tasks.size();
+    }
+
+    // Empties the log after its changes reached the snapshot.
+    void resetLog() {
+        LogHeader header = {};
+        memcpy(header.magic, LOG_MAGIC, sizeof(header.magic));
+        header.version = LOG_VERSION;
+        header.byteOrder = BYTE_ORDER_MARK;
+        if (ftruncate(logFd, 0) != 0)
+            fail("Can't truncate", logPath);
+        writeAll(logFd, reinterpret_cast<const char*>(&header), sizeof(header), 0, logPath);
+        if (fdatasync(logFd) != 0)
+            fail("Can't sync", logPath);
+        logBytes = sizeof(header);
+        logChanges = 0;
+    }
+
+    // Checks the log header and walks the complete batches, cutting off a
+    // torn or corrupt tail and leaving logBytes at the end of the last good
+    // batch. Folds the batches into changes unless it is null.
+    void scanLog(ChangeSet* changes) {
+        MappedFile file(logPath);
+        LogHeader header;
+        if (file.size < sizeof(header)) {
+            resetLog();
+            return;
+        }
+        memcpy(&header, file.data, sizeof(header));
+        if (memcmp(header.magic, LOG_MAGIC, sizeof(header.magic)) != 0 || header.byteOrder != BYTE_ORDER_MARK)
+            throw runtime_error("Storage error: corrupt log " + logPath);
+        if (header.version != LOG_VERSION)
+            throw runtime_error("Storage error: unsupported log version " + to_string(header.version));
+
+        size_t offset = sizeof(header);
+        size_t replayed = 0;
+        while (file.size - offset >= sizeof(BatchHeader)) {
+            BatchHeader batch;
+            memcpy(&batch, file.data + offset, sizeof(batch));
+            const char* payload = file.data + offset + sizeof(batch);
+            if (batch.payloadBytes > file.size - offset - sizeof(batch) ||
+                checksum(payload, batch.payloadBytes) != batch.checksum)
+                break;
+            Reader in{payload, payload + batch.payloadBytes};
+            uint32_t count = in.read<uint32_t>();
+            for (uint32_t i = 0; changes && i < count; i++) {
+                uint8_t kind = in.read<uint8_t>();
+                string id = in.readString();
+                if (kind == DeleteChange) {
+                    changes->insert_or_assign(std::move(id), nullopt);
+                    continue;
+                }
+                string description = in.readString();
+                string category = in.readString();
+                int64_t sequence = in.read<int64_t>();
+                int64_t dueAt = in.read<int64_t>();
+                int64_t remainingHours = in.read<int64_t>();
+                DeadlineSpan deadline;
+                deadline.years = in.read<int32_t>();
+                deadline.months = in.read<int32_t>();
+                deadline.days = in.read<int32_t>();
+                TaskStatus status = in.read<uint8_t>() ? TaskStatus::Complete : TaskStatus::Incomplete;
+                Task task(id, std::move(description), category, status, remainingHours, deadline, sequence, dueAt);
+                changes->insert_or_assign(std::move(id), std::move(task));
+            }
+            offset += sizeof(batch) + batch.payloadBytes;
+            replayed += count;
+        }
+        if (offset < file.size && ftruncate(logFd, static_cast<off_t>(offset)) != 0)
+            fail("Can't truncate", logPath);
+        logBytes = offset;
+        logChanges = replayed;
+    }
+
+    ChangeSet replayLog() {
+        ChangeSet changes;
+        scanLog(&changes);
+        return changes;
+    }
+
+    size_t snapshotTaskCount() {
+        MappedFile file(snapshotPath);
+        SnapshotHeader header;
+        if (file.size < sizeof(header))
+            return 0;
+        memcpy(&header, file.data, sizeof(header));
+        return static_cast<size_t>(header.taskCount);
+    }
+
+    static void encodeChange(string& out, const string& id, const optional<Task>& state) {
+        put(out, static_cast<uint8_t>(state ? UpsertChange : DeleteChange));
+        putString(out, id);
+        if (!state)
+            return;
+        const Task& task = *state;
+        putString(out, task.description);
+        putString(out, task.category());
+        put(out, static_cast<int64_t>(task.sequence));
+        put(out, static_cast<int64_t>(task.dueAt));
+        put(out, static_cast<int64_t>(task.remainingHours));
+        put(out, static_cast<int32_t>(task.deadline.years));
+        put(out, static_cast<int32_t>(task.deadline.months));
+        put(out, static_cast<int32_t>(task.deadline.days));
+        put(out, static_cast<uint8_t>(task.status));
+    }
+
+public:
+    // Opens (creating if needed) <basePath>.snap and <basePath>.log. The log
+    // is locked, checked and positioned after its last complete batch here,
+    // so writeChanges appends correctly whether or not loadTasks ran first;
+    // throws if the log is corrupt or already in use.
+    explicit LogStorage(const string& basePath = "tasks", const LogProfile& logProfile = LogProfile())
+        : snapshotPath(basePath + ".snap"), logPath(basePath + ".log"), profile(logProfile), logFd(-1), logBytes(0),
+          logChanges(0), snapshotTasks(0), hadData(false) {
+        struct stat info;
+        hadData = stat(snapshotPath.c_str(), &info) == 0 ||
+                  (stat(logPath.c_str(), &info) == 0 && static_cast<size_t>(info.st_size) > sizeof(LogHeader));
+        logFd = open(logPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (logFd < 0)
+            fail("Can't open", logPath);
+        try {
+            // Taken before the scan, which may cut off a tail another
+            // writer is still appending.
+            if (flock(logFd, LOCK_EX | LOCK_NB) != 0) {
+                if (errno == EWOULDBLOCK)
+                    throw runtime_error("Storage error: log is in use " + logPath);
+                fail("Can't lock", logPath);
+            }
+            scanLog(nullptr);
+            snapshotTasks = snapshotTaskCount();
+        } catch (const runtime_error &) {
+            close(logFd);
+            throw;
+        }
+    }
+
+    LogStorage(const LogStorage&) = delete;
+    LogStorage& operator=(const LogStorage&) = delete;
+
+    ~LogStorage() { close(logFd); }
+
+    // False when neither file held tasks at open, e.g. to import from SQLite.
+    bool hasData() const { return hadData; }
+
+    size_t logChangeCount() const { return logChanges; }
+
+    // The snapshot with the log replayed over it.
+    vector<Task> loadTasks() override {
+        TASK_TIME(dbLoadTasks);
+        vector<Task> tasks = readSnapshot();
+        snapshotTasks = tasks.size();
+        ChangeSet changes = replayLog();
+        if (!changes.empty()) {
+            vector<Task> kept;
+            kept.reserve(tasks.size() + changes.size());
+            for (auto &task : tasks) {
+                if (!changes.count(task.id))
+                    kept.push_back(std::move(task));
+            }
+            for (auto &change : changes) {
+                if (change.second)
+                    kept.push_back(std::move(*change.second));
+            }
+            tasks.swap(kept);
+        }
+        TASK_COUNT(dbRowsLoaded, tasks.size());
+        return tasks;
+    }
+
+    // Appends the changes as one batch, then compacts if the log has grown
+    // past the profile's limits.
+    void writeChanges(const ChangeSet& changes) override {
+        if (changes.empty())
+            return;
+        TASK_TIME(dbWriteChanges);
+        string batch(sizeof(BatchHeader), '\0');
+        put(batch, static_cast<uint32_t>(changes.size()));
+        for (const auto &change : changes)
+            encodeChange(batch, change.first, change.second);
+        BatchHeader header;
+        header.payloadBytes = static_cast<uint32_t>(batch.size() - sizeof(header));
+        header.checksum = checksum(batch.data() + sizeof(header), header.payloadBytes);
+        memcpy(&batch[0], &header, sizeof(header));
+        try {
+            writeAll(logFd, batch.data(), batch.size(), static_cast<off_t>(logBytes), logPath);
+            if (profile.syncWrites && fdatasync(logFd) != 0)
+                fail("Can't sync", logPath);
+        } catch (const runtime_error &) {
+            // Drop any partial batch. Should that fail too, the next append
+            // overwrites it from logBytes and replay cuts off any leftover.
+            int ignored = ftruncate(logFd, static_cast<off_t>(logBytes));
+            (void)ignored;
+            throw;
+        }
+        logBytes += batch.size();
+        logChanges += changes.size();
+        TASK_COUNT(dbRowsWritten, changes.size());
+        if (logChanges >= profile.compactMinChanges && logChanges >= profile.compactRatio * snapshotTasks)
+            compact();
+    }
+
+    // Writes the current tasks to a new snapshot and empties the log.
+    void compact() {
+        TASK_TIME(logCompact);
+        replaceAll(loadTasks());
+    }
+
+    // Makes tasks the entire stored set.
+    void replaceAll(const vector<Task>& tasks) {
+        writeSnapshot(tasks);
+        resetLog();
+        hadData = true;
+    }
+};
+
+#endif
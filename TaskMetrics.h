@@ -0,0 +1,199 @@
+#ifndef TASK_METRICS_H
+#define TASK_METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// Process-wide counters and timers for the tree and database hot paths. All
+// updates are relaxed atomic adds, so instrumented code stays cheap and
+// thread-safe. Build with -DTASK_METRICS=0 to compile every TASK_COUNT /
+// TASK_TIME site out entirely.
+#ifndef TASK_METRICS
+#define TASK_METRICS 1
+#endif
+
+// Call count plus total and longest duration of one instrumented operation.
+struct MetricTimer {
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> totalNs{0};
+    std::atomic<uint64_t> maxNs{0};
+
+    void record(uint64_t ns) {
+        count.fetch_add(1, std::memory_order_relaxed);
+        totalNs.fetch_add(ns, std::memory_order_relaxed);
+        uint64_t longest = maxNs.load(std::memory_order_relaxed);
+        while (ns > longest && !maxNs.compare_exchange_weak(longest, ns, std::memory_order_relaxed)) {
+        }
+    }
+
+    void reset() {
+        count = 0;
+        totalNs = 0;
+        maxNs = 0;
+    }
+};
+
+class TaskMetrics {
+public:
+    MetricTimer treeInsert;
+    MetricTimer treeDelete;
+    MetricTimer treeUpdateStatus;
+    MetricTimer treeRebuild;
+    MetricTimer treeRecomputeDeadlines;
+    MetricTimer dbLoadTasks;
+    MetricTimer dbWriteChanges;
+    MetricTimer dbRebuildTasks;
+    MetricTimer logCompact; // LogStorage snapshot rewrites
+    MetricTimer archiveStep; // TaskArchiver steps
+
+    // An update status is a delete plus an insert, and counts in both.
+    std::atomic<uint64_t> insertRotations{0};
+    std::atomic<uint64_t> deleteRotations{0};
+    std::atomic<uint64_t> tasksRebuilt{0};   // tasks placed by AVLTree::rebuild
+    std::atomic<uint64_t> dbStatements{0};   // statements run to completion
+    std::atomic<uint64_t> dbTransactions{0}; // committed
+    std::atomic<uint64_t> dbRollbacks{0};
+    std::atomic<uint64_t> dbRowsLoaded{0};
+    std::atomic<uint64_t> dbRowsWritten{0};  // by writeChanges and rebuildTasks
+    std::atomic<uint64_t> tasksArchived{0};  // moved to a cold table by TaskArchiver
+
+    static TaskMetrics& shared() {
+        static TaskMetrics metrics;
+        return metrics;
+    }
+
+    // Human-readable summary for the stats menu option.
+    std::string summary() const {
+        std::string text;
+        char line[160];
+        auto timer = [&](const char* name, const MetricTimer& t) {
+            uint64_t count = t.count.load();
+            snprintf(line, sizeof(line), "%-20s %10llu calls  avg %10.1f us  max %10.1f us\n", name,
+                     static_cast<unsigned long long>(count), count ? t.totalNs.load() / 1e3 / count : 0.0,
+                     t.maxNs.load() / 1e3);
+            text += line;
+        };
+        auto ratio = [&](const char* name, double value) {
+            snprintf(line, sizeof(line), "%-20s %10.2f\n", name, value);
+            text += line;
+        };
+        auto counter = [&](const char* name, uint64_t value) {
+            snprintf(line, sizeof(line), "%-20s %10llu\n", name, static_cast<unsigned long long>(value));
+            text += line;
+        };
+        timer("tree insert", treeInsert);
+        timer("tree delete", treeDelete);
+        timer("tree update status", treeUpdateStatus);
+        timer("tree rebuild", treeRebuild);
+        timer("tree recompute", treeRecomputeDeadlines);
+        timer("db loadTasks", dbLoadTasks);
+        timer("db writeChanges", dbWriteChanges);
+        timer("db rebuildTasks", dbRebuildTasks);
+        timer("log compact", logCompact);
+        timer("archive step", archiveStep);
+        uint64_t inserts = treeInsert.count + treeUpdateStatus.count;
+        uint64_t deletes = treeDelete.count + treeUpdateStatus.count;
+        ratio("rotations/insert", inserts ? static_cast<double>(insertRotations) / inserts : 0.0);
+        ratio("rotations/delete", deletes ? static_cast<double>(deleteRotations) / deletes : 0.0);
+        counter("tasks rebuilt", tasksRebuilt);
+        counter("db statements", dbStatements);
+        counter("db transactions", dbTransactions);
+        counter("db rollbacks", dbRollbacks);
+        counter("db rows loaded", dbRowsLoaded);
+        counter("db rows written", dbRowsWritten);
+        counter("tasks archived", tasksArchived);
+        uint64_t loadNs = dbLoadTasks.totalNs;
+        ratio("load rows/sec", loadNs ? dbRowsLoaded.load() * 1e9 / loadNs : 0.0);
+        return text;
+    }
+
+    // Prometheus text exposition format.
+    std::string prometheus() const {
+        std::string text;
+        auto sample = [&](const std::string& series, double value) {
+            char number[32];
+            snprintf(number, sizeof(number), "%.9g", value);
+            text += series + " " + number + "\n";
+        };
+        struct Timed {
+            const char* op;
+            const MetricTimer& timer;
+        };
+        const Timed timers[] = {{"tree_insert", treeInsert},
+                                {"tree_delete", treeDelete},
+                                {"tree_update_status", treeUpdateStatus},
+                                {"tree_rebuild", treeRebuild},
+                                {"tree_recompute_deadlines", treeRecomputeDeadlines},
+                                {"db_load_tasks", dbLoadTasks},
+                                {"db_write_changes", dbWriteChanges},
+                                {"db_rebuild_tasks", dbRebuildTasks},
+                                {"log_compact", logCompact},
+                                {"archive_step", archiveStep}};
+        text += "# HELP task_manager_operation_seconds Time spent in tree and database operations.\n"
+                "# TYPE task_manager_operation_seconds summary\n";
+        for (const Timed& t : timers) {
+            std::string labels = std::string("{op=\"") + t.op + "\"}";
+            sample("task_manager_operation_seconds_count" + labels, static_cast<double>(t.timer.count.load()));
+            sample("task_manager_operation_seconds_sum" + labels, t.timer.totalNs.load() / 1e9);
+        }
+        text += "# HELP task_manager_operation_max_seconds Longest single call of each operation.\n"
+                "# TYPE task_manager_operation_max_seconds gauge\n";
+        for (const Timed& t : timers)
+            sample(std::string("task_manager_operation_max_seconds{op=\"") + t.op + "\"}", t.timer.maxNs.load() / 1e9);
+        auto counter = [&](const char* name, const char* help, uint64_t value) {
+            text += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " counter\n";
+            sample(name, static_cast<double>(value));
+        };
+        counter("task_manager_insert_rotations_total", "AVL rotations while inserting.", insertRotations);
+        counter("task_manager_delete_rotations_total", "AVL rotations while deleting.", deleteRotations);
+        counter("task_manager_tasks_rebuilt_total", "Tasks placed by tree rebuilds.", tasksRebuilt);
+        counter("task_manager_db_statements_total", "SQLite statements executed.", dbStatements);
+        counter("task_manager_db_transactions_total", "SQLite transactions committed.", dbTransactions);
+        counter("task_manager_db_rollbacks_total", "SQLite transactions rolled back.", dbRollbacks);
+        counter("task_manager_db_rows_loaded_total", "Rows read by loadTasks.", dbRowsLoaded);
+        counter("task_manager_db_rows_written_total", "Rows written by writeChanges and rebuildTasks.", dbRowsWritten);
+        counter("task_manager_tasks_archived_total", "Complete tasks moved to the archive.", tasksArchived);
+        return text;
+    }
+
+    void reset() {
+        for (MetricTimer* t : {&treeInsert, &treeDelete, &treeUpdateStatus, &treeRebuild, &treeRecomputeDeadlines,
+                               &dbLoadTasks, &dbWriteChanges, &dbRebuildTasks, &logCompact, &archiveStep})
+            t->reset();
+        for (std::atomic<uint64_t>* c : {&insertRotations, &deleteRotations, &tasksRebuilt, &dbStatements,
+                                         &dbTransactions, &dbRollbacks, &dbRowsLoaded, &dbRowsWritten,
+                                         &tasksArchived})
+            *c = 0;
+    }
+};
+
+// Records the lifetime of the enclosing scope into a MetricTimer.
+class ScopedTimer {
+private:
+    MetricTimer& timer;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    explicit ScopedTimer(MetricTimer& t) : timer(t), start(std::chrono::steady_clock::now()) {}
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+    ~ScopedTimer() {
+        timer.record(static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()));
+    }
+};
+
+#if TASK_METRICS
+#define TASK_METRIC_CONCAT_(a, b) a##b
+#define TASK_METRIC_CONCAT(a, b) TASK_METRIC_CONCAT_(a, b)
+#define TASK_COUNT(counter, n) TaskMetrics::shared().counter.fetch_add((n), std::memory_order_relaxed)
+#define TASK_TIME(timer) ScopedTimer TASK_METRIC_CONCAT(scopedTimer, __LINE__)(TaskMetrics::shared().timer)
+#else
+#define TASK_COUNT(counter, n) ((void)(n)) // n may have side effects
+#define TASK_TIME(timer) ((void)0)
+#endif
+
+#endif
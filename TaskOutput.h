@@ -0,0 +1,192 @@
+#ifndef TASK_OUTPUT_H
+#define TASK_OUTPUT_H
+
+#include "SmartTaskManager.h"
+#include <charconv>
+#include <ostream>
+
+// How TaskWriter lays out a task:
+//   Text       the menu's "Priority N | ID: ... | Status: ..." lines
+//   Tsv        priority, id, description, category, status, remaining hours,
+//              due time (Unix seconds) and deadline text; tabs and line
+//              breaks inside text become spaces
+//   JsonLines  one JSON object per task with the same fields
+enum class OutputFormat { Text, Tsv, JsonLines };
+
+inline OutputFormat parseOutputFormat(const string& name) {
+    if (name == "text") return OutputFormat::Text;
+    if (name == "tsv") return OutputFormat::Tsv;
+    if (name == "json") return OutputFormat::JsonLines;
+    throw runtime_error("Unknown output format: " + name);
+}
+
+// Formats tasks into one reusable buffer, with to_chars for numbers and no
+// temporary strings, and hands it to the stream in large chunks rather than
+// a few bytes per <<. Pair with ios::sync_with_stdio(false), so those chunks
+// go straight to the stream's own buffer. Flushed when destroyed.
+class TaskWriter {
+public:
+    // Optional Text columns; ID, description and status are always shown.
+    // TEXT_DUE_IN shows "OVERDUE" or the hours left until dueAt.
+    enum TextColumns { TEXT_CATEGORY = 1, TEXT_DEADLINE = 2, TEXT_DUE_IN = 4 };
+
+    // Priority of a task outside the tree, e.g. an archived one: Text leaves
+    // the Priority column out, Tsv leaves the field empty and JsonLines
+    // writes null.
+    static const int NO_PRIORITY = 0;
+
+private:
+    static const size_t CHUNK = 256 * 1024;
+
+    ostream& out;
+    OutputFormat format;
+    string buffer;
+
+    void appendNumber(long long value) {
+        char digits[24];
+        auto result = to_chars(digits, digits + sizeof(digits), value);
+        buffer.append(digits, result.ptr);
+    }
+
+    // Replaces the characters that would split a TSV field or record.
+    void appendField(const string& text) {
+        size_t start = buffer.size();
+        buffer += text;
+        for (size_t i = start; i < buffer.size(); i++) {
+            char c = buffer[i];
+            if (c == '\t' || c == '\n' || c == '\r')
+                buffer[i] = ' ';
+        }
+    }
+
+    void appendJsonString(const string& text) {
+        static const char hex[] = "0123456789abcdef";
+        buffer += '"';
+        for (unsigned char c : text) {
+            if (c == '"' || c == '\\') {
+                buffer += '\\';
+                buffer += static_cast<char>(c);
+            } else if (c == '\n') {
+                buffer += "\\n";
+            } else if (c == '\t') {
+                buffer += "\\t";
+            } else if (c < 0x20) {
+                buffer += "\\u00";
+                buffer += hex[c >> 4];
+                buffer += hex[c & 15];
+            } else {
+                buffer += static_cast<char>(c);
+            }
+        }
+        buffer += '"';
+    }
+
+public:
+    explicit TaskWriter(ostream& stream, OutputFormat f = OutputFormat::Text) : out(stream), format(f) {
+        buffer.reserve(CHUNK + 4096);
+    }
+
+    TaskWriter(const TaskWriter&) = delete;
+    TaskWriter& operator=(const TaskWriter&) = delete;
+
+    ~TaskWriter() { flush(); }
+
+    OutputFormat outputFormat() const { return format; }
+
+    // textColumns only applies to Text; the other formats have every field.
+    // now is the current time for TEXT_DUE_IN.
+    void write(const Task& task, int priority, int textColumns = TEXT_DEADLINE, long long now = 0) {
+        if (format == OutputFormat::Text) {
+            if (priority != NO_PRIORITY) {
+                buffer += "Priority ";
+                appendNumber(priority);
+                buffer += " | ";
+            }
+            buffer += "ID: ";
+            buffer += task.id;
+            buffer += " | Desc: ";
+            buffer += task.description;
+            if (textColumns & TEXT_CATEGORY) {
+                buffer += " | Category: ";
+                buffer += task.category();
+            }
+            if (textColumns & TEXT_DEADLINE) {
+                buffer += " | Deadline: ";
+                task.deadline.appendTo(buffer, task.remainingHours);
+            }
+            if (textColumns & TEXT_DUE_IN) {
+                if (task.dueAt <= now) {
+                    buffer += " | OVERDUE";
+                } else {
+                    buffer += " | due in ";
+                    appendNumber((task.dueAt - now) / 3600);
+                    buffer += " hour(s)";
+                }
+            }
+            buffer += " | Status: ";
+            buffer += statusName(task.status);
+            buffer += '\n';
+        } else if (format == OutputFormat::Tsv) {
+            if (priority != NO_PRIORITY)
+                appendNumber(priority);
+            buffer += '\t';
+            appendField(task.id);
+            buffer += '\t';
+            appendField(task.description);
+            buffer += '\t';
+            appendField(task.category());
+            buffer += '\t';
+            buffer += statusName(task.status);
+            buffer += '\t';
+            appendNumber(task.remainingHours);
+            buffer += '\t';
+            appendNumber(task.dueAt);
+            buffer += '\t';
+            task.deadline.appendTo(buffer, task.remainingHours);
+            buffer += '\n';
+        } else {
+            buffer += "{\"priority\":";
+            if (priority != NO_PRIORITY)
+                appendNumber(priority);
+            else
+                buffer += "null";
+            buffer += ",\"id\":";
+            appendJsonString(task.id);
+            buffer += ",\"description\":";
+            appendJsonString(task.description);
+            buffer += ",\"category\":";
+            appendJsonString(task.category());
+            buffer += ",\"status\":\"";
+            buffer += statusName(task.status);
+            buffer += "\",\"remainingHours\":";
+            appendNumber(task.remainingHours);
+            buffer += ",\"dueAt\":";
+            appendNumber(task.dueAt);
+            buffer += ",\"deadline\":\"";
+            task.deadline.appendTo(buffer, task.remainingHours); // digits and plain words only
+            buffer += "\"}\n";
+        }
+        if (buffer.size() >= CHUNK)
+            flush();
+    }
+
+    // Headings and counts for the Text layout, in order with the tasks;
+    // dropped for Tsv and JsonLines so those stay one record per line.
+    void write(const string& text) {
+        if (format != OutputFormat::Text)
+            return;
+        buffer += text;
+        if (buffer.size() >= CHUNK)
+            flush();
+    }
+
+    void flush() {
+        if (!buffer.empty()) {
+            out.write(buffer.data(), static_cast<streamsize>(buffer.size()));
+            buffer.clear();
+        }
+        out.flush();
+    }
+};
+
+#endif
@@ -0,0 +1,607 @@
+#ifndef TASK_SERVER_H
+#define TASK_SERVER_H
+
+#include "TaskShards.h"
+#include <atomic>
+#include <cerrno>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <deque>
+#include <unordered_set>
+
+// Where TaskServer listens and which teams clients may switch to. There is
+// no authentication, so the default is loopback only. teams lists the teams
+// TEAM accepts besides the server's own; "*" accepts any valid team name,
+// which lets clients create tables.
+struct ServerProfile {
+    string address = "127.0.0.1";
+    vector<string> teams;
+};
+
+// TCP front-end for the team task lists in a TaskShards, so one process can
+// hold the trees and serve every client instead of each CLI reloading the
+// table. A single epoll thread handles all connections with non-blocking
+// sockets. Each connection starts on the server's default team; TEAM
+// switches it to another team the profile allows. A team not loaded yet is
+// loaded on a separate thread, and the connection's later requests wait for
+// it while other connections carry on. The protocol is line-based, with
+// tab-separated fields:
+//
+//   TEAM <name>                                                            -> OK
+//   INSERT <id> <description> <category> <years> <months> <days> <hours>   -> OK <priority>
+//   STATUS <id> complete|incomplete                                        -> OK <priority>
+//   DELETE <id>                                                            -> OK
+//   SEARCH <id>                                                            -> OK <task> (priority 0 if archived)
+//   LIST <offset> <limit>                                                  -> OK <count>, then count <task> lines
+//   FIND <words> <offset> <limit>                                          -> OK <count> <total>, then count <task> lines
+//   METRICS                                                                -> OK <count>, then count lines of
+//                                                                             Prometheus text (see TaskMetrics)
+//   PING                                                                   -> OK
+//   SUBSCRIBE                                                              -> OK, then an <event> line per change
+//                                                                             to the team's tasks from then on
+//
+// An <event> is EVENT, the hub's event version, then upsert and the task's
+// fields without a priority, or delete and the ID. A subscriber that falls
+// too far behind gets EVENT overflow once events were dropped and should
+// LIST again.
+// A <task> is priority, id, description, category, status, remaining hours
+// and due time (Unix seconds), tab-separated. Failures answer ERR <message>.
+// Clients may pipeline: every complete line in a read is answered in order.
+// Writes are group-committed: after each round of ready connections each
+// team's journal written to is flushed once, in one transaction, and the
+// round's replies are sent only once that commit is done. If the commit
+// fails the error is logged, the changes stay queued for the journal to
+// retry, and the replies go out regardless.
+class TaskServer {
+private:
+    static const size_t MAX_LINE = 64 * 1024;
+    static const size_t MAX_READ = 1024 * 1024;        // bytes read from one connection per round
+    static const size_t MAX_BACKLOG = 4 * 1024 * 1024; // unsent reply bytes before reading pauses
+    static const int MAX_EVENTS = 64;
+    static const size_t EVENT_QUEUE = 4096; // events buffered per subscriber
+
+    struct Connection {
+        int fd = -1;
+        uint64_t serial = 0; // tells apart connections that reuse an fd
+        bool loading = false; // TEAM is waiting for a team to load
+        string in;
+        string out;
+        size_t sent = 0;
+        bool closing = false;
+        uint32_t events = EPOLLIN; // interest currently registered with epoll
+        TaskShard* shard = nullptr; // team the requests apply to
+        TaskShard* subscribedShard = nullptr;
+        shared_ptr<TaskEventQueue> changes; // set by SUBSCRIBE
+    };
+
+    TaskShards& shards;
+    TaskShard& defaultShard;
+    unordered_set<TaskShard*> written; // shards changed this round, flushed for group commit
+    int listenFd;
+    int epollFd;
+    int wakeFd; // stop(), the loader and event queues write here to break epoll_wait
+    uint16_t boundPort;
+    atomic<bool> stopping;
+    bool anyTeam;
+    unordered_set<string> allowedTeams;
+    uint64_t nextSerial;
+
+    // A TEAM request for a team not loaded yet, handed to the loader thread
+    // and handed back through loaded with shard or error set.
+    struct TeamLoad {
+        int fd;
+        uint64_t serial;
+        string team;
+        TaskShard* shard;
+        string error;
+    };
+    mutex loadMutex;
+    condition_variable loadWake;
+    deque<TeamLoad> toLoad;
+    deque<TeamLoad> loaded;
+    thread loader;
+    unordered_map<int, Connection> connections;
+    unordered_set<int> subscribers; // connections with a change queue
+    thread loop;
+
+    static vector<string> splitFields(const string& line) {
+        vector<string> fields;
+        size_t start = 0;
+        while (true) {
+            size_t tab = line.find('\t', start);
+            fields.push_back(line.substr(start, tab == string::npos ? string::npos : tab - start));
+            if (tab == string::npos)
+                return fields;
+            start = tab + 1;
+        }
+    }
+
+    static int parseInt(const string& field) {
+        size_t used = 0;
+        int value = stoi(field, &used);
+        if (used != field.size())
+            throw invalid_argument("not a number: " + field);
+        return value;
+    }
+
+    // Replies are line-based, so tabs and line breaks inside text are blanked.
+    static void appendText(string& out, const string& text) {
+        for (char c : text)
+            out += (c == '\t' || c == '\n' || c == '\r') ? ' ' : c;
+    }
+
+    static void appendTask(string& out, const Task& task, int priority) {
+        out += to_string(priority);
+        out += '\t';
+        appendTaskFields(out, task);
+    }
+
+    static void appendTaskFields(string& out, const Task& task) {
+        appendText(out, task.id);
+        out += '\t';
+        appendText(out, task.description);
+        out += '\t';
+        appendText(out, task.category());
+        out += '\t';
+        out += statusName(task.status);
+        out += '\t';
+        out += to_string(task.remainingHours);
+        out += '\t';
+        out += to_string(task.dueAt);
+        out += '\n';
+    }
+
+    // Answers one request into conn.out; returns true if it changed the
+    // connection's team store.
+    bool handle(const string& line, Connection& conn) {
+        vector<string> fields = splitFields(line);
+        const string& command = fields[0];
+        string& out = conn.out;
+        TaskStore& store = conn.shard->store;
+        try {
+            if (command == "TEAM" && fields.size() == 2) {
+                const string& team = fields[1];
+                if (!teamAllowed(team))
+                    throw runtime_error("Team not served: " + team);
+                if (TaskShard* ready = shards.loadedShard(team)) {
+                    conn.shard = ready;
+                    out += "OK\n";
+                    return false;
+                }
+                // Answered by finishLoads once the loader is done.
+                conn.loading = true;
+                {
+                    lock_guard<mutex> lock(loadMutex);
+                    toLoad.push_back(TeamLoad{conn.fd, conn.serial, team, nullptr, string()});
+                }
+                loadWake.notify_one();
+                return false;
+            }
+            if (command == "INSERT" && fields.size() == 8) {
+                int priority = store.insert(Task::dueIn(fields[1], fields[2], fields[3], parseInt(fields[4]),
+                                                        parseInt(fields[5]), parseInt(fields[6]), parseInt(fields[7])));
+                out += "OK " + to_string(priority) + "\n";
+                return true;
+            }
+            if (command == "STATUS" && fields.size() == 3 && (fields[2] == "complete" || fields[2] == "incomplete")) {
+                int priority = store.updateTaskStatus(fields[1], parseStatus(fields[2]));
+                out += "OK " + to_string(priority) + "\n";
+                return true;
+            }
+            if (command == "DELETE" && fields.size() == 2) {
+                store.deleteTask(fields[1]);
+                out += "OK\n";
+                return true;
+            }
+            if (command == "SEARCH" && fields.size() == 2) {
+                optional<Task> task = store.search(fields[1]);
+                if (!task && conn.shard->archiver()) {
+                    task = conn.shard->archiver()->find(fields[1]);
+                    if (task)
+                        task->priority = 0;
+                }
+                if (!task)
+                    throw runtime_error("Task not found.");
+                out += "OK\t";
+                appendTask(out, *task, task->priority);
+                return false;
+            }
+            if (command == "LIST" && fields.size() == 3) {
+                int offset = max(parseInt(fields[1]), 0);
+                int limit = max(parseInt(fields[2]), 0);
+                if (store.hotSet()) {
+                    // Complete tasks past the tree are read from cold storage.
+                    long long last = min<long long>(static_cast<long long>(offset) + limit, INT_MAX);
+                    vector<Task> page = limit == 0 ? vector<Task>() : store.range(offset + 1, static_cast<int>(last));
+                    out += "OK " + to_string(page.size()) + "\n";
+                    for (const auto &task : page)
+                        appendTask(out, task, task.priority);
+                    return false;
+                }
+                // Formatted under the read lock, without copying the tasks.
+                store.read([&](const AVLTree& tree) {
+                    auto page = tree.listRange(offset, limit);
+                    out += "OK " + to_string(page.end().priority() - page.begin().priority()) + "\n";
+                    for (auto it = page.begin(); it != page.end(); ++it)
+                        appendTask(out, *it, it.priority());
+                });
+                return false;
+            }
+#if TASK_METRICS
+            if (command == "METRICS" && fields.size() == 1) {
+                string text = TaskMetrics::shared().prometheus();
+                out += "OK " + to_string(count(text.begin(), text.end(), '\n')) + "\n";
+                out += text;
+                return false;
+            }
+#endif
+            if (command == "FIND" && fields.size() == 4) {
+                size_t total = 0;
+                vector<Task> page = store.searchText(fields[1], max(parseInt(fields[2]), 0), max(parseInt(fields[3]), 0),
+                                                     total);
+                out += "OK " + to_string(page.size()) + " " + to_string(total) + "\n";
+                for (const auto &task : page)
+                    appendTask(out, task, task.priority);
+                return false;
+            }
+            if (command == "SUBSCRIBE" && fields.size() == 1) {
+                if (conn.changes)
+                    throw runtime_error("Already subscribed.");
+                conn.changes = conn.shard->events.subscribeQueue(EVENT_QUEUE, [this]() { wake(); });
+                conn.subscribedShard = conn.shard;
+                subscribers.insert(conn.fd);
+                out += "OK\n";
+                return false;
+            }
+            if (command == "PING" && fields.size() == 1) {
+                out += "OK\n";
+                return false;
+            }
+            throw invalid_argument("unrecognised request");
+        } catch (const exception& e) {
+            out += "ERR ";
+            appendText(out, e.what());
+            out += '\n';
+            return false;
+        }
+    }
+
+    bool teamAllowed(const string& team) const {
+        return team == defaultShard.team || (anyTeam ? TaskShards::validTeamName(team) : allowedTeams.count(team) > 0);
+    }
+
+    void wake() {
+        uint64_t one = 1;
+        ssize_t ignored = write(wakeFd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+    // Answers every complete line received, noting the shards written to,
+    // until a TEAM has to wait for its team to load.
+    void answerLines(Connection& conn) {
+        size_t start = 0, newline;
+        while (!conn.loading && (newline = conn.in.find('\n', start)) != string::npos) {
+            string line = conn.in.substr(start, newline - start);
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            if (!line.empty() && handle(line, conn))
+                written.insert(conn.shard);
+            start = newline + 1;
+        }
+        conn.in.erase(0, start);
+        if (!conn.loading && conn.in.size() > MAX_LINE) {
+            conn.out += "ERR request too long\n";
+            conn.closing = true;
+        }
+    }
+
+    // Reads what the socket has and answers it.
+    void readFrom(int fd, Connection& conn) {
+        char buffer[16 * 1024];
+        size_t received = 0;
+        while (!conn.closing && received < MAX_READ) {
+            ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+            if (n > 0) {
+                conn.in.append(buffer, n);
+                received += n;
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (n < 0 && errno == EINTR)
+                continue;
+            conn.closing = true; // EOF or error: answer what arrived, then close
+        }
+        answerLines(conn);
+    }
+
+    void runLoader() {
+        unique_lock<mutex> lock(loadMutex);
+        while (true) {
+            loadWake.wait(lock, [this] { return stopping || !toLoad.empty(); });
+            if (stopping)
+                return;
+            TeamLoad job = std::move(toLoad.front());
+            toLoad.pop_front();
+            lock.unlock();
+            try {
+                job.shard = &shards.shard(job.team);
+            } catch (const exception& e) {
+                job.error = e.what();
+            }
+            lock.lock();
+            loaded.push_back(std::move(job));
+            wake();
+        }
+    }
+
+    // Answers the TEAM requests whose loads finished, then the requests
+    // queued behind them; returns those connections in ready.
+    void finishLoads(vector<int>& ready) {
+        deque<TeamLoad> done;
+        {
+            lock_guard<mutex> lock(loadMutex);
+            done.swap(loaded);
+        }
+        for (auto &job : done) {
+            auto it = connections.find(job.fd);
+            if (it == connections.end() || it->second.serial != job.serial)
+                continue; // closed meanwhile
+            Connection& conn = it->second;
+            conn.loading = false;
+            if (job.shard) {
+                conn.shard = job.shard;
+                conn.out += "OK\n";
+            } else {
+                conn.out += "ERR ";
+                appendText(conn.out, job.error);
+                conn.out += '\n';
+            }
+            answerLines(conn);
+            ready.push_back(job.fd);
+        }
+    }
+
+    // Sends as much of the reply buffer as the socket takes and updates the
+    // epoll interest: writable while replies are pending, readable unless
+    // closing or too far behind. Returns false once the connection should be
+    // dropped.
+    bool sendTo(int fd, Connection& conn) {
+        while (conn.sent < conn.out.size()) {
+            ssize_t n = send(fd, conn.out.data() + conn.sent, conn.out.size() - conn.sent, MSG_NOSIGNAL);
+            if (n > 0) {
+                conn.sent += n;
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else {
+                return false;
+            }
+        }
+        if (conn.sent == conn.out.size()) {
+            conn.out.clear();
+            conn.sent = 0;
+            if (conn.closing && !conn.loading)
+                return false;
+        }
+        size_t backlog = conn.out.size() - conn.sent;
+        bool readable = !conn.closing && !conn.loading && backlog <= MAX_BACKLOG;
+        uint32_t events = (readable ? uint32_t(EPOLLIN) : 0u) | (backlog ? uint32_t(EPOLLOUT) : 0u);
+        if (events != conn.events) {
+            epoll_event ev{};
+            ev.events = events;
+            ev.data.fd = fd;
+            epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &ev);
+            conn.events = events;
+        }
+        return true;
+    }
+
+    // Moves queued change events into subscribers' replies, unless a
+    // subscriber is already too far behind; returns those with new output.
+    void deliverEvents(vector<int>& ready) {
+        for (int fd : subscribers) {
+            Connection& conn = connections[fd];
+            size_t before = conn.out.size();
+            conn.changes->rearm();
+            TaskEvent event;
+            while (conn.out.size() - conn.sent <= MAX_BACKLOG && conn.changes->pop(event)) {
+                conn.out += "EVENT\t" + to_string(event.version);
+                if (event.task) {
+                    conn.out += "\tupsert\t";
+                    appendTaskFields(conn.out, *event.task);
+                } else {
+                    conn.out += "\tdelete\t";
+                    appendText(conn.out, event.id);
+                    conn.out += '\n';
+                }
+            }
+            if (conn.changes->overflowed())
+                conn.out += "EVENT\toverflow\n";
+            if (conn.out.size() != before)
+                ready.push_back(fd);
+        }
+    }
+
+    void unsubscribe(Connection& conn) {
+        if (conn.changes) {
+            conn.subscribedShard->events.unsubscribe(conn.changes);
+            conn.changes.reset();
+            subscribers.erase(conn.fd);
+        }
+    }
+
+    void closeConnection(int fd) {
+        unsubscribe(connections[fd]);
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        connections.erase(fd);
+    }
+
+    void acceptAll() {
+        while (true) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+                return; // EAGAIN, or a failed accept: try again on the next event
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.fd = fd;
+            if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                close(fd);
+                continue;
+            }
+            Connection& conn = connections[fd];
+            conn.fd = fd;
+            conn.serial = nextSerial++;
+            conn.shard = &defaultShard;
+        }
+    }
+
+    void run() {
+        epoll_event events[MAX_EVENTS];
+        vector<int> ready;
+        while (!stopping) {
+            int n = epoll_wait(epollFd, events, MAX_EVENTS, -1);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                break;
+            ready.clear();
+            for (int i = 0; i < n; i++) {
+                int fd = events[i].data.fd;
+                if (fd == wakeFd) {
+                    uint64_t count;
+                    ssize_t ignored = read(wakeFd, &count, sizeof(count));
+                    (void)ignored;
+                    continue;
+                }
+                if (fd == listenFd) {
+                    acceptAll();
+                    continue;
+                }
+                auto it = connections.find(fd);
+                if (it == connections.end())
+                    continue;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    readFrom(fd, it->second);
+                ready.push_back(fd);
+            }
+            finishLoads(ready);
+            // One transaction per written team for this round, before the
+            // replies go out. On failure the journal keeps the changes and
+            // retries them in the background, as for menu edits.
+            for (TaskShard* shard : written) {
+                try {
+                    shard->journal().flush();
+                } catch (const runtime_error& e) {
+                    cerr << "Task server: database error: " << e.what() << "\n";
+                }
+            }
+            written.clear();
+            deliverEvents(ready);
+            for (int fd : ready) {
+                auto it = connections.find(fd);
+                if (it != connections.end() && !sendTo(fd, it->second))
+                    closeConnection(fd);
+            }
+        }
+    }
+
+public:
+    // Listens on profile.address at port (0 picks a free one; see port()).
+    // Connections start on team, which is loaded here.
+    TaskServer(TaskShards& s, const string& team, uint16_t port, const ServerProfile& profile = ServerProfile())
+        : shards(s), defaultShard(s.shard(team)), listenFd(-1), epollFd(-1), wakeFd(-1), boundPort(0), stopping(false),
+          anyTeam(false), nextSerial(0) {
+        for (const auto &name : profile.teams) {
+            if (name == "*")
+                anyTeam = true;
+            else if (!TaskShards::validTeamName(name))
+                throw runtime_error("Invalid team name: " + name);
+            else
+                allowedTeams.insert(name);
+        }
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        if (inet_pton(AF_INET, profile.address.c_str(), &addr.sin_addr) != 1)
+            throw runtime_error("Invalid listen address: " + profile.address);
+        try {
+            listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (listenFd < 0)
+                throw runtime_error(string("Can't create socket: ") + strerror(errno));
+            int one = 1;
+            setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(listenFd, SOMAXCONN) < 0)
+                throw runtime_error("Can't listen on " + profile.address + " port " + to_string(port) + ": " +
+                                    strerror(errno));
+            socklen_t length = sizeof(addr);
+            getsockname(listenFd, reinterpret_cast<sockaddr*>(&addr), &length);
+            boundPort = ntohs(addr.sin_port);
+
+            epollFd = epoll_create1(EPOLL_CLOEXEC);
+            wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (epollFd < 0 || wakeFd < 0)
+                throw runtime_error(string("Can't set up epoll: ") + strerror(errno));
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.fd = listenFd;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &ev);
+            ev.data.fd = wakeFd;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev);
+        } catch (...) {
+            closeAll();
+            throw;
+        }
+        loop = thread(&TaskServer::run, this);
+        loader = thread(&TaskServer::runLoader, this);
+    }
+
+    TaskServer(const TaskServer&) = delete;
+    TaskServer& operator=(const TaskServer&) = delete;
+
+    ~TaskServer() {
+        stop();
+    }
+
+    uint16_t port() const { return boundPort; }
+
+    // Stops the event loop and closes every connection; replies not yet
+    // sent are dropped. Waits for a team load already running.
+    void stop() {
+        if (!loop.joinable())
+            return;
+        {
+            lock_guard<mutex> lock(loadMutex);
+            stopping = true;
+        }
+        loadWake.notify_one();
+        wake();
+        loop.join();
+        loader.join();
+        closeAll();
+    }
+
+private:
+    void closeAll() {
+        for (auto &conn : connections) {
+            unsubscribe(conn.second);
+            close(conn.first);
+        }
+        connections.clear();
+        if (listenFd >= 0) close(listenFd);
+        if (epollFd >= 0) close(epollFd);
+        if (wakeFd >= 0) close(wakeFd);
+        listenFd = epollFd = wakeFd = -1;
+    }
+};
+
+#endif
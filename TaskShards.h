@@ -0,0 +1,241 @@
+#ifndef TASK_SHARDS_H
+#define TASK_SHARDS_H
+
+#include "TaskArchive.h"
+#include "TaskEvents.h"
+#include <functional>
+#include <memory>
+
+// One team's task list: its own tree, ID map and priority sequence, its own
+// storage (a separate table or file) and its own write-behind journal, so
+// nothing done to it touches or locks another team's list.
+class TaskShard {
+private:
+    friend class TaskShards;
+
+    // Declared so the journal is destroyed (and flushed) before its storage.
+    unique_ptr<TaskStorage> storage;
+    unique_ptr<TaskStorage> coldStorage; // hot-set mode: read connection for tasks outside the tree
+    once_flag loaded;
+    atomic<bool> ready; // set once the shard is loaded and archiving, if any, started
+    unique_ptr<WriteBehindJournal> writer;
+    unique_ptr<DBManager> archiveStorage;
+    unique_ptr<TaskArchiver> archiving; // stopped before the store and journal go
+
+    // cold is a second connection to the same storage when the store should
+    // run in hot-set mode (SQLite only); otherwise it is null.
+    void load(unique_ptr<TaskStorage> s, unique_ptr<TaskStorage> cold, size_t hotSetCapacity, const TaskOrder& order,
+              size_t undoSteps) {
+        DBManager* coldDb = dynamic_cast<DBManager*>(cold.get());
+        if (coldDb && undoSteps > 0)
+            throw runtime_error("Snapshots are not available in hot-set mode.");
+        store.setOrder(order);
+        // Kept here until the load succeeds: if it throws, s goes with this
+        // call, and neither the shard nor the store may point at it.
+        unique_ptr<WriteBehindJournal> journal(new WriteBehindJournal(*s));
+        if (coldDb)
+            store.enableHotSet(*coldDb, journal.get(), hotSetCapacity);
+        else
+            store.rebuild(s->loadTasks());
+        if (undoSteps > 0)
+            store.enableSnapshots(undoSteps);
+        storage = std::move(s);
+        coldStorage = std::move(cold);
+        writer = std::move(journal);
+        events.setDownstream(writer.get());
+        store.setJournal(&events);
+    }
+
+    void startArchiving(unique_ptr<DBManager> db, const ArchiveProfile& profile) {
+        archiveStorage = std::move(db);
+        archiving.reset(new TaskArchiver(store, *archiveStorage, profile));
+    }
+
+public:
+    const string team;
+    // Every change to store, passed on to the journal; subscribe here to
+    // follow the team's tasks.
+    TaskEventHub events;
+    TaskStore store;
+
+    explicit TaskShard(const string& name) : ready(false), team(name) {}
+
+    TaskShard(const TaskShard&) = delete;
+    TaskShard& operator=(const TaskShard&) = delete;
+
+    ~TaskShard() {
+        archiving.reset();
+        store.setJournal(nullptr);
+    }
+
+    WriteBehindJournal& journal() { return *writer; }
+
+    // Null unless TaskShards::enableArchive was called.
+    TaskArchiver* archiver() { return archiving.get(); }
+};
+
+// Task lists keyed by team name. A shard is loaded from its storage on first
+// access, so startup does not grow with the number of teams; the map lock is
+// held only to find or add an entry, never while a shard loads or runs.
+class TaskShards {
+public:
+    // Opens the storage holding one team's tasks.
+    typedef function<unique_ptr<TaskStorage>(const string& team)> StorageFactory;
+    // Opens the cold table one team's old complete tasks are archived to.
+    typedef function<unique_ptr<DBManager>(const string& team)> ArchiveFactory;
+
+    static constexpr const char* DEFAULT_TEAM = "default";
+
+    // Letters, digits and '_', so a name can be used in table and file names.
+    static bool validTeamName(const string& team) {
+        return !team.empty() && team.size() <= 64 && all_of(team.begin(), team.end(), [](char c) {
+            return isalnum(static_cast<unsigned char>(c)) || c == '_';
+        });
+    }
+
+private:
+    StorageFactory openStorage;
+    size_t hotSetCapacity;
+    ArchiveFactory openArchive;
+    ArchiveProfile archiveProfile;
+    size_t undoSteps;
+    TaskOrder defaultOrder;
+    unordered_map<string, TaskOrder> teamOrders;
+    mutex shardsMutex;
+    unordered_map<string, unique_ptr<TaskShard>> shards;
+
+    // Calls f on every loaded shard's journal; throws the first failure
+    // after trying them all.
+    template <typename F>
+    void forEachJournal(F f) {
+        vector<TaskShard*> loaded;
+        {
+            lock_guard<mutex> lock(shardsMutex);
+            for (const auto &entry : shards) {
+                if (entry.second->ready)
+                    loaded.push_back(entry.second.get());
+            }
+        }
+        string error;
+        for (TaskShard* s : loaded) {
+            try {
+                f(s->journal());
+            } catch (const runtime_error &e) {
+                if (error.empty())
+                    error = e.what();
+            }
+        }
+        if (!error.empty())
+            throw runtime_error(error);
+    }
+
+public:
+    // A non-zero hotSetCapacity runs SQLite-backed shards in TaskStore's
+    // hot-set mode, keeping that many complete tasks in memory.
+    explicit TaskShards(StorageFactory factory, size_t hotSetCapacity = 0)
+        : openStorage(std::move(factory)), hotSetCapacity(hotSetCapacity), undoSteps(0) {}
+
+    TaskShards(const TaskShards&) = delete;
+    TaskShards& operator=(const TaskShards&) = delete;
+
+    // Order for shards loaded from now on, unless setTeamOrder gave their
+    // team its own.
+    void setOrder(const TaskOrder& order) {
+        lock_guard<mutex> lock(shardsMutex);
+        defaultOrder = order;
+    }
+
+    void setTeamOrder(const string& team, const TaskOrder& order) {
+        lock_guard<mutex> lock(shardsMutex);
+        teamOrders[team] = order;
+    }
+
+    TaskOrder orderFor(const string& team) {
+        lock_guard<mutex> lock(shardsMutex);
+        auto it = teamOrders.find(team);
+        return it == teamOrders.end() ? defaultOrder : it->second;
+    }
+
+    // Gives every shard loaded from now on a TaskArchiver writing to the
+    // table factory opens. Call before the first shard() to cover them all.
+    void enableArchive(ArchiveFactory factory, const ArchiveProfile& profile) {
+        lock_guard<mutex> lock(shardsMutex);
+        openArchive = std::move(factory);
+        archiveProfile = profile;
+    }
+
+    // Runs every shard loaded from now on in TaskStore's snapshot mode,
+    // keeping steps changes for undo. Not combined with hot-set mode.
+    void enableUndo(size_t steps) {
+        lock_guard<mutex> lock(shardsMutex);
+        undoSteps = steps;
+    }
+
+    // The team's shard, loading it if this is the first access. Concurrent
+    // first accesses to one team load it once; a failed load throws and is
+    // retried by the next access.
+    TaskShard& shard(const string& team) {
+        if (!validTeamName(team))
+            throw runtime_error("Invalid team name: " + team);
+        TaskShard* s;
+        {
+            lock_guard<mutex> lock(shardsMutex);
+            unique_ptr<TaskShard>& slot = shards[team];
+            if (!slot)
+                slot.reset(new TaskShard(team));
+            s = slot.get();
+        }
+        call_once(s->loaded, [&]() {
+            unique_ptr<TaskStorage> storage = openStorage(team);
+            unique_ptr<TaskStorage> cold;
+            if (hotSetCapacity > 0 && dynamic_cast<DBManager*>(storage.get()))
+                cold = openStorage(team);
+            ArchiveFactory archive;
+            ArchiveProfile profile;
+            size_t undo;
+            {
+                lock_guard<mutex> lock(shardsMutex);
+                archive = openArchive;
+                profile = archiveProfile;
+                undo = undoSteps;
+            }
+            // Opened first, so a failure leaves the shard unloaded.
+            unique_ptr<DBManager> archiveDb = archive ? archive(team) : nullptr;
+            s->load(std::move(storage), std::move(cold), hotSetCapacity, orderFor(team), undo);
+            if (archiveDb)
+                s->startArchiving(std::move(archiveDb), profile);
+            s->ready = true;
+        });
+        return *s;
+    }
+
+    // The team's shard if it has finished loading, else null; never loads
+    // or waits for a load.
+    TaskShard* loadedShard(const string& team) {
+        lock_guard<mutex> lock(shardsMutex);
+        auto it = shards.find(team);
+        return it != shards.end() && it->second->ready ? it->second.get() : nullptr;
+    }
+
+    // Teams accessed so far, sorted.
+    vector<string> loadedTeams() {
+        vector<string> teams;
+        lock_guard<mutex> lock(shardsMutex);
+        for (const auto &entry : shards) {
+            if (entry.second->ready)
+                teams.push_back(entry.first);
+        }
+        sort(teams.begin(), teams.end());
+        return teams;
+    }
+
+    // Writes every loaded shard's pending changes; throws the first failure
+    // after trying them all.
+    void flush() { forEachJournal([](WriteBehindJournal& journal) { journal.flush(); }); }
+
+    // flush(), also stopping each journal's flusher thread (see
+    // WriteBehindJournal::close); for shutdown.
+    void close() { forEachJournal([](WriteBehindJournal& journal) { journal.close(); }); }
+};
+
+#endif
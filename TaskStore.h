@@ -0,0 +1,432 @@
+#ifndef TASK_STORE_H
+#define TASK_STORE_H
+
+#include "PersistentTaskTree.h"
+#include <list>
+#include <shared_mutex>
+
+// Thread-safe wrapper around AVLTree for embedding in a multithreaded
+// service. Any number of readers run concurrently under a shared lock; a
+// writer takes the lock exclusively. Nothing returned points into the tree:
+// lookups return copies (with priority filled in), so a result stays valid
+// whatever other threads do afterwards.
+class TaskStore {
+private:
+    // shared_mutex on its own lets a steady stream of readers starve writers.
+    // Both sides pass through gate to acquire the lock, and a writer holds it
+    // until existing readers drain, so waiting writers block new readers.
+    mutable mutex gate;
+    mutable shared_mutex lock;
+    AVLTree tree;
+
+    // Hot-set mode (see enableHotSet). coldMutex guards the cold connection
+    // and the recency list, which readers reorder under the shared lock.
+    DBManager* cold;
+    WriteBehindJournal* coldJournal;
+    size_t completeCapacity;
+    long long coldMaxSequence;
+    mutable mutex coldMutex;
+    mutable list<string> recentComplete; // complete tasks in the tree, most recently used first
+    mutable unordered_map<string, list<string>::iterator> recentPosition;
+
+    // Snapshot mode (see enableSnapshots): the tree journals into versions,
+    // which passes changes on to journal.
+    TaskJournal* journal;
+    unique_ptr<VersionedTaskTree> versions;
+
+    class ReadGuard {
+    private:
+        shared_mutex& lock;
+
+    public:
+        explicit ReadGuard(const TaskStore& store) : lock(store.lock) {
+            lock_guard<mutex> turn(store.gate);
+            lock.lock_shared();
+        }
+        ~ReadGuard() { lock.unlock_shared(); }
+    };
+
+    class WriteGuard {
+    private:
+        shared_mutex& lock;
+
+    public:
+        explicit WriteGuard(const TaskStore& store) : lock(store.lock) {
+            lock_guard<mutex> turn(store.gate);
+            lock.lock();
+        }
+        ~WriteGuard() { lock.unlock(); }
+    };
+
+    // Inside a WriteGuard: in snapshot mode the changes made while it lives
+    // become one version, so one store write is one undo step.
+    class VersionBatch {
+    private:
+        VersionedTaskTree* versions;
+
+    public:
+        explicit VersionBatch(const TaskStore& store) : versions(store.versions.get()) {
+            if (versions)
+                versions->beginBatch();
+        }
+        ~VersionBatch() {
+            if (versions)
+                versions->commitBatch();
+        }
+    };
+
+    // Helpers for hot-set mode; callers hold the lock (the write lock where
+    // noted) and, for the cold ones, coldMutex. Cold reads flush the journal
+    // first so they see every change made so far.
+    void flushCold() const {
+        if (coldJournal)
+            coldJournal->flush();
+    }
+
+    int incompleteCount() const {
+        return tree.lowerBound(OrderKey{1, LONG_MIN, LLONG_MIN}).priority() - 1;
+    }
+
+    // Priority of a complete task among all tasks, hot or cold.
+    int coldPriority(const Task& task) const {
+        flushCold();
+        return incompleteCount() + 1 + cold->countCompleteBefore(task.remainingHours, task.sequence);
+    }
+
+    int priorityOf(const Task& task) const {
+        if (!cold || !task.isComplete())
+            return tree.rankOf(task.id);
+        lock_guard<mutex> coldLock(coldMutex);
+        return coldPriority(task);
+    }
+
+    void touch(const string& id) const {
+        lock_guard<mutex> coldLock(coldMutex);
+        auto it = recentPosition.find(id);
+        if (it != recentPosition.end())
+            recentComplete.splice(recentComplete.begin(), recentComplete, it->second);
+    }
+
+    // Write lock: marks id most recently used and unloads the least recently
+    // used complete tasks past the capacity.
+    void remember(const string& id) {
+        lock_guard<mutex> coldLock(coldMutex);
+        auto it = recentPosition.find(id);
+        if (it != recentPosition.end()) {
+            recentComplete.splice(recentComplete.begin(), recentComplete, it->second);
+            return;
+        }
+        recentComplete.push_front(id);
+        recentPosition.emplace(id, recentComplete.begin());
+        while (recentComplete.size() > completeCapacity) {
+            tree.unload(recentComplete.back());
+            recentPosition.erase(recentComplete.back());
+            recentComplete.pop_back();
+        }
+    }
+
+    void forget(const string& id) {
+        lock_guard<mutex> coldLock(coldMutex);
+        auto it = recentPosition.find(id);
+        if (it != recentPosition.end()) {
+            recentComplete.erase(it->second);
+            recentPosition.erase(it);
+        }
+    }
+
+    static bool sameExceptStatus(const Task& a, const Task& b) {
+        return a.description == b.description && a.categoryId == b.categoryId && a.remainingHours == b.remainingHours &&
+               a.dueAt == b.dueAt && a.sequence == b.sequence && a.deadline.years == b.deadline.years &&
+               a.deadline.months == b.deadline.months && a.deadline.days == b.deadline.days;
+    }
+
+    // Write lock: puts task id into state, through the tree's usual
+    // journaled operations.
+    void restore(const string& id, const Task* state) {
+        const Task* task = tree.search(id);
+        if (task && state && sameExceptStatus(*task, *state)) {
+            tree.updateTaskStatus(id, state->status);
+            return;
+        }
+        if (task)
+            tree.deleteTask(id);
+        if (state)
+            tree.insert(*state);
+    }
+
+    // Write lock: loads id from cold storage unless it is already in the tree.
+    void pageIn(const string& id) {
+        if (tree.search(id))
+            return;
+        optional<Task> task;
+        {
+            lock_guard<mutex> coldLock(coldMutex);
+            flushCold();
+            task = cold->findTask(id);
+        }
+        if (!task)
+            return;
+        bool complete = task->isComplete();
+        tree.load(std::move(*task));
+        if (complete)
+            remember(id);
+    }
+
+public:
+    TaskStore() : cold(nullptr), coldJournal(nullptr), completeCapacity(0), coldMaxSequence(0), journal(nullptr) {}
+
+    TaskStore(const TaskStore&) = delete;
+    TaskStore& operator=(const TaskStore&) = delete;
+
+    // Runs f(const AVLTree&) under the shared lock and returns its result.
+    // Use for anything not covered below (iteration, queries); references
+    // obtained inside f must not escape it.
+    template <typename F>
+    auto read(F f) const -> decltype(f(declval<const AVLTree&>())) {
+        ReadGuard guard(*this);
+        return f(static_cast<const AVLTree&>(tree));
+    }
+
+    // Runs f(AVLTree&) under the exclusive lock, for compound mutations that
+    // must appear atomic to readers. In snapshot mode f must change tasks
+    // only through journaled calls (not rebuild, setOrder, load or unload),
+    // and its changes are one version, undone together.
+    template <typename F>
+    auto write(F f) -> decltype(f(declval<AVLTree&>())) {
+        WriteGuard guard(*this);
+        VersionBatch batch(*this);
+        return f(tree);
+    }
+
+    void setJournal(TaskJournal* j) {
+        WriteGuard guard(*this);
+        journal = j;
+        if (versions)
+            versions->setDownstream(j);
+        else
+            tree.setJournal(j);
+    }
+
+    void rebuild(vector<Task> tasks) {
+        WriteGuard guard(*this);
+        tree.rebuild(std::move(tasks));
+        if (versions)
+            versions->reset(tree.listTasks(), tree.ordering());
+    }
+
+    // Snapshot mode: keeps a VersionedTaskTree mirror of the tree, so
+    // snapshot() gives readers a consistent view they can walk without
+    // holding the lock while writers carry on, and undo() reverts the last
+    // writes. Costs a second copy of every task plus O(log n) new nodes
+    // per change. Not available in hot-set mode.
+    void enableSnapshots(size_t maxUndo) {
+        WriteGuard guard(*this);
+        if (cold)
+            throw runtime_error("Snapshots are not available in hot-set mode.");
+        versions.reset(new VersionedTaskTree(maxUndo, journal));
+        versions->reset(tree.listTasks(), tree.ordering());
+        tree.setJournal(versions.get());
+    }
+
+    // The current version in snapshot mode, else null.
+    shared_ptr<const TaskSnapshot> snapshot() const {
+        return versions ? versions->snapshot() : nullptr;
+    }
+
+    // Reverts the last steps writes (fewer if less history is kept) and
+    // returns how many were undone; the journal sees the reverting changes.
+    // A write is one insert, status update or delete, or one write() call.
+    // Throws unless in snapshot mode.
+    size_t undo(size_t steps) {
+        WriteGuard guard(*this);
+        if (!versions)
+            throw runtime_error("Undo needs snapshot mode.");
+        return versions->undo(steps, [this](const string& id, const Task* state) { restore(id, state); });
+    }
+
+    // See AVLTree::setOrder. Hot-set mode keeps the default order, which
+    // its cold-storage queries assume.
+    void setOrder(TaskOrder order) {
+        WriteGuard guard(*this);
+        if (cold && order.policy != TaskOrder::ByRemainingHours)
+            throw runtime_error("Hot-set mode needs the deadline order.");
+        tree.setOrder(std::move(order));
+        if (versions)
+            versions->reset(tree.listTasks(), tree.ordering());
+    }
+
+    // Hot-set mode, for tables much larger than the set of tasks in use: the
+    // tree then holds the incomplete tasks plus the completeCapacity most
+    // recently used complete ones. Other complete tasks stay in db, which
+    // must be a connection of its own (journal writes through another).
+    // search, size, range and listTasks cover every task, reading db past
+    // the tree; updateTaskStatus and deleteTask page a task in first. read,
+    // query and searchText see only the tree. Loads db's incomplete tasks.
+    void enableHotSet(DBManager& db, WriteBehindJournal* journal, size_t capacity) {
+        WriteGuard guard(*this);
+        if (tree.ordering().policy != TaskOrder::ByRemainingHours)
+            throw runtime_error("Hot-set mode needs the deadline order.");
+        if (versions)
+            throw runtime_error("Snapshots are not available in hot-set mode.");
+        db.ensureStatusIndex();
+        tree.rebuild(db.loadIncompleteTasks());
+        cold = &db;
+        coldJournal = journal;
+        completeCapacity = max<size_t>(capacity, 1);
+        coldMaxSequence = db.maxSequence();
+        recentComplete.clear();
+        recentPosition.clear();
+    }
+
+    bool hotSet() const { return cold != nullptr; }
+
+    // Assigns the next sequence under the lock, so concurrent inserts never
+    // share one. Returns the new task's priority.
+    int insert(Task task) {
+        WriteGuard guard(*this);
+        VersionBatch batch(*this);
+        task.sequence = tree.nextSequence();
+        if (cold && !tree.search(task.id)) {
+            lock_guard<mutex> coldLock(coldMutex);
+            flushCold();
+            if (cold->findTask(task.id))
+                throw runtime_error("Task with the same ID already exists.");
+            task.sequence = max(task.sequence, coldMaxSequence + 1);
+        }
+        string id = task.id;
+        bool complete = task.isComplete();
+        tree.insert(std::move(task));
+        if (cold && complete)
+            remember(id);
+        return priorityOf(*tree.search(id));
+    }
+
+    // Returns the task's new priority.
+    int updateTaskStatus(const string& id, TaskStatus newStatus) {
+        WriteGuard guard(*this);
+        VersionBatch batch(*this);
+        if (cold)
+            pageIn(id);
+        tree.updateTaskStatus(id, newStatus);
+        if (cold && newStatus == TaskStatus::Complete)
+            remember(id);
+        else if (cold)
+            forget(id);
+        return priorityOf(*tree.search(id));
+    }
+
+    void deleteTask(const string& id) {
+        WriteGuard guard(*this);
+        VersionBatch batch(*this);
+        if (cold)
+            pageIn(id);
+        tree.deleteTask(id);
+        if (cold)
+            forget(id);
+    }
+
+    // Deletes each of tasks still complete with the same due time, in one
+    // write-locked pass, and returns the IDs deleted (see TaskArchiver).
+    vector<string> deleteUnchanged(const vector<Task>& tasks) {
+        WriteGuard guard(*this);
+        VersionBatch batch(*this);
+        vector<string> deleted;
+        for (const auto &expected : tasks) {
+            const Task* task = tree.search(expected.id);
+            if (!task || !task->isComplete() || task->dueAt != expected.dueAt)
+                continue;
+            tree.deleteTask(expected.id);
+            if (cold)
+                forget(expected.id);
+            deleted.push_back(expected.id);
+        }
+        return deleted;
+    }
+
+    // In hot-set mode a miss is looked up in cold storage, without loading
+    // the task into the tree.
+    optional<Task> search(const string& id) const {
+        ReadGuard guard(*this);
+        const Task* task = tree.search(id);
+        if (task) {
+            Task copy = *task;
+            copy.priority = priorityOf(copy);
+            if (cold && copy.isComplete())
+                touch(id);
+            return copy;
+        }
+        if (!cold)
+            return nullopt;
+        lock_guard<mutex> coldLock(coldMutex);
+        flushCold();
+        optional<Task> stored = cold->findTask(id);
+        if (stored)
+            stored->priority = coldPriority(*stored);
+        return stored;
+    }
+
+    int size() const {
+        ReadGuard guard(*this);
+        if (!cold)
+            return tree.size();
+        lock_guard<mutex> coldLock(coldMutex);
+        flushCold();
+        return incompleteCount() + cold->countCompleteTasks();
+    }
+
+    // Tasks with priorities first..last, as in AVLTree::range. In hot-set
+    // mode complete tasks come from cold storage.
+    vector<Task> range(int first, int last) const {
+        ReadGuard guard(*this);
+        if (!cold)
+            return tree.range(first, last);
+        first = max(first, 1);
+        int hot = incompleteCount();
+        vector<Task> tasks = tree.range(first, min(last, hot));
+        if (last > hot) {
+            int from = max(first, hot + 1);
+            lock_guard<mutex> coldLock(coldMutex);
+            flushCold();
+            vector<Task> page = cold->loadCompleteTasks(from - hot - 1, last - from + 1);
+            for (size_t i = 0; i < page.size(); i++) {
+                page[i].priority = from + static_cast<int>(i);
+                tasks.push_back(std::move(page[i]));
+            }
+        }
+        return tasks;
+    }
+
+    // Copies of every task matching q, in the order AVLTree::query visits them.
+    vector<Task> query(const TaskQuery& q, size_t limit = SIZE_MAX) const {
+        ReadGuard guard(*this);
+        vector<Task> tasks;
+        tree.query(q, [&](const Task& task) {
+            tasks.push_back(task);
+            tasks.back().priority = tree.rankOf(task.id);
+        }, limit);
+        return tasks;
+    }
+
+    // One page of AVLTree::searchText results, with priority filled in;
+    // total is set to the number of matches.
+    vector<Task> searchText(const string& text, size_t offset, size_t limit, size_t& total) const {
+        ReadGuard guard(*this);
+        vector<Task> tasks;
+        total = tree.searchText(text, [&](const Task& task, int priority) {
+            tasks.push_back(task);
+            tasks.back().priority = priority;
+        }, offset, limit);
+        return tasks;
+    }
+
+    // In hot-set mode this reads the whole cold table into memory; page
+    // through range() instead where that matters.
+    vector<Task> listTasks() const {
+        if (hotSet())
+            return range(1, INT_MAX);
+        ReadGuard guard(*this);
+        return tree.listTasks();
+    }
+};
+
+#endif
@@ -0,0 +1,324 @@
+// Benchmarks for the AVLTree, the menu's insert/update flows, DBManager and
+// LogStorage.
+//
+//   g++ -std=c++17 -O2 bench_task_manager.cpp -o bench_task_manager -lsqlite3 -pthread
+//   ./bench_task_manager [--json] [--sizes 1000,100000,1000000] [--db bench_tasks.db]
+//
+// Every benchmark runs against a store of each size and reports ops/sec,
+// p50/p99 latency and heap allocations per op. --json prints one JSON
+// object per line instead of the table, for tracking regressions.
+#include "TaskStore.h"
+#include "TaskLogStorage.h"
+#include "TaskOutput.h"
+#include <atomic>
+#include <cstdio>
+#include <new>
+#include <random>
+#include <sstream>
+
+// Counts every heap allocation. Sized deallocations from the standard
+// library end up in free() below, which GCC would otherwise flag.
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+static atomic<size_t> allocationCount(0);
+
+void* operator new(size_t size) {
+    allocationCount.fetch_add(1, memory_order_relaxed);
+    if (void* p = malloc(size ? size : 1))
+        return p;
+    throw bad_alloc();
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+struct BenchResult {
+    string name;
+    int size;
+    size_t ops;
+    double seconds;
+    double p50Ns;
+    double p99Ns;
+    double allocationsPerOp;
+};
+
+class Bench {
+private:
+    bool json;
+
+public:
+    explicit Bench(bool jsonOutput) : json(jsonOutput) {
+        if (!json)
+            printf("%-22s %9s %9s %14s %12s %12s %12s\n", "benchmark", "tasks", "ops", "ops/sec", "p50 (ns)",
+                   "p99 (ns)", "allocs/op");
+    }
+
+    // Times op(i) for i in [0, ops), after an untimed prepare(i).
+    template <typename Prepare, typename Op>
+    void run(const string& name, int size, size_t ops, Prepare prepare, Op op) {
+        vector<double> latencies;
+        latencies.reserve(ops);
+        size_t allocations = 0;
+        double total = 0;
+        for (size_t i = 0; i < ops; i++) {
+            prepare(i);
+            size_t allocationsBefore = allocationCount.load(memory_order_relaxed);
+            auto start = chrono::steady_clock::now();
+            op(i);
+            auto stop = chrono::steady_clock::now();
+            allocations += allocationCount.load(memory_order_relaxed) - allocationsBefore;
+            double ns = chrono::duration<double, nano>(stop - start).count();
+            latencies.push_back(ns);
+            total += ns;
+        }
+        sort(latencies.begin(), latencies.end());
+        BenchResult r{name, size, ops, total / 1e9, latencies[(ops - 1) / 2], latencies[(ops - 1) * 99 / 100],
+                      static_cast<double>(allocations) / ops};
+        report(r);
+    }
+
+    template <typename Op>
+    void run(const string& name, int size, size_t ops, Op op) {
+        run(name, size, ops, [](size_t) {}, op);
+    }
+
+    void report(const BenchResult& r) {
+        double opsPerSecond = r.seconds > 0 ? r.ops / r.seconds : 0;
+        if (json) {
+            printf("{\"benchmark\":\"%s\",\"tasks\":%d,\"ops\":%zu,\"seconds\":%.6f,\"ops_per_sec\":%.1f,"
+                   "\"p50_ns\":%.0f,\"p99_ns\":%.0f,\"allocs_per_op\":%.2f}\n",
+                   r.name.c_str(), r.size, r.ops, r.seconds, opsPerSecond, r.p50Ns, r.p99Ns, r.allocationsPerOp);
+        } else {
+            printf("%-22s %9d %9zu %14.0f %12.0f %12.0f %12.2f\n", r.name.c_str(), r.size, r.ops, opsPerSecond,
+                   r.p50Ns, r.p99Ns, r.allocationsPerOp);
+        }
+        fflush(stdout);
+    }
+};
+
+static const char* const CATEGORIES[] = {"Work", "Home", "Study", "Health", "Errands", "Finance", "Travel", "Misc"};
+
+static vector<Task> makeTasks(int n, mt19937& rng) {
+    vector<Task> tasks;
+    tasks.reserve(n);
+    for (int i = 0; i < n; i++) {
+        long hours = rng() % 10000;
+        TaskStatus status = rng() % 4 == 0 ? TaskStatus::Complete : TaskStatus::Incomplete;
+        tasks.emplace_back("t" + to_string(i), "task number " + to_string(i), CATEGORIES[rng() % 8], status, hours,
+                           DeadlineSpan::fromHours(hours), i + 1, time(nullptr) + hours * 3600LL);
+    }
+    return tasks;
+}
+
+static void removeDatabase(const string& path) {
+    remove(path.c_str());
+    remove((path + "-wal").c_str());
+    remove((path + "-shm").c_str());
+}
+
+static void removeLogStorage(const string& base) {
+    remove((base + ".snap").c_str());
+    remove((base + ".log").c_str());
+}
+
+static void benchTree(Bench& bench, const vector<Task>& tasks, mt19937& rng) {
+    int n = static_cast<int>(tasks.size());
+    size_t ops = min(n, 100000);
+    size_t repeats = max<size_t>(1, min<size_t>(50, 1000000 / n));
+    AVLTree tree;
+    tree.rebuild(tasks);
+
+    vector<Task> fresh;
+    fresh.reserve(ops);
+    for (size_t i = 0; i < ops; i++) {
+        long hours = rng() % 10000;
+        fresh.emplace_back("n" + to_string(i), "new task", CATEGORIES[i % 8], TaskStatus::Incomplete, hours,
+                           DeadlineSpan::fromHours(hours), tree.nextSequence() + i);
+    }
+    bench.run("tree.insert", n, ops, [&](size_t i) { tree.insert(std::move(fresh[i])); });
+
+    vector<string> ids;
+    for (size_t i = 0; i < ops; i++)
+        ids.push_back(tasks[rng() % n].id);
+    const AVLTree& view = tree;
+    bench.run("tree.search", n, ops, [&](size_t i) {
+        if (!view.search(ids[i]))
+            throw runtime_error("missing task " + ids[i]);
+    });
+
+    // The first search builds the word index; time that once, then queries.
+    bench.run("tree.buildTextIndex", n, 1, [&](size_t) { view.searchText("work", [](const Task&, int) {}, 0, 10); });
+    vector<string> queries;
+    for (size_t i = 0; i < min<size_t>(ops, 1000); i++)
+        queries.push_back(string(CATEGORIES[i % 8]) + " number " + to_string(rng() % n).substr(0, 2));
+    bench.run("tree.searchText", n, queries.size(),
+              [&](size_t i) { view.searchText(queries[i], [](const Task&, int) {}, 0, 20); });
+
+    for (size_t i = 0; i < ops; i++)
+        ids[i] = "n" + to_string(i);
+    bench.run("tree.deleteTask", n, ops, [&](size_t i) { tree.deleteTask(ids[i]); });
+
+    bench.run("tree.listTasks", n, repeats, [&](size_t) {
+        if (static_cast<int>(tree.listTasks().size()) != n)
+            throw runtime_error("listTasks size mismatch");
+    });
+
+    // Each run moves the clock forward an hour, so every task changes key.
+    long long now = time(nullptr);
+    bench.run("tree.recomputeDeadlines", n, repeats, [&](size_t i) { tree.recomputeDeadlines(now + 3600LL * (i + 1)); });
+
+    vector<Task> copy;
+    bench.run("tree.rebuild", n, repeats, [&](size_t) { copy = tasks; }, [&](size_t) { tree.rebuild(std::move(copy)); });
+}
+
+// The menu's Insert and Update Status flows: duplicate check, then the store
+// call, with a WriteBehindJournal attached as in Main.cpp.
+static void benchFlows(Bench& bench, const vector<Task>& tasks, const string& dbPath) {
+    int n = static_cast<int>(tasks.size());
+    size_t ops = min(n, 20000);
+    removeDatabase(dbPath);
+    DBManager db(dbPath);
+    TaskStore store;
+    store.rebuild(tasks);
+    {
+        WriteBehindJournal journal(db);
+        store.setJournal(&journal);
+
+        vector<string> ids;
+        for (size_t i = 0; i < ops; i++)
+            ids.push_back("f" + to_string(i));
+        bench.run("flow.insert", n, ops, [&](size_t i) {
+            if (store.search(ids[i]))
+                throw runtime_error("duplicate " + ids[i]);
+            store.insert(Task::dueIn(ids[i], "flow task", CATEGORIES[i % 8], 0, 0, static_cast<int>(i % 30), 0));
+        });
+        bench.run("flow.updateStatus", n, ops, [&](size_t i) {
+            if (!store.search(ids[i]))
+                throw runtime_error("missing " + ids[i]);
+            store.updateTaskStatus(ids[i], TaskStatus::Complete);
+        });
+        journal.flush();
+        store.setJournal(nullptr);
+    }
+}
+
+static void benchDatabase(Bench& bench, vector<Task> tasks, const string& dbPath) {
+    int n = static_cast<int>(tasks.size());
+    size_t repeats = max<size_t>(1, min<size_t>(20, 200000 / n));
+    size_t rowOps = min(n, 2000);
+    removeDatabase(dbPath);
+    DBManager db(dbPath);
+    {
+        DBManager::Transaction transaction(db);
+        db.insertTasks(tasks, 64);
+        transaction.commit();
+    }
+
+    bench.run("db.loadTasks", n, repeats, [&](size_t) {
+        if (static_cast<int>(db.loadTasks().size()) != n)
+            throw runtime_error("loadTasks size mismatch");
+    });
+
+    // Each run flips the status of a different 1% of the tasks.
+    size_t changed = max(1, n / 100);
+    bench.run("db.rebuildTasks", n, repeats, [&](size_t r) {
+        for (size_t i = 0; i < changed; i++) {
+            Task& task = tasks[(r * changed + i) % n];
+            task.status = task.isComplete() ? TaskStatus::Incomplete : TaskStatus::Complete;
+        }
+    }, [&](size_t) { db.rebuildTasks(tasks); });
+
+    vector<Task> rows;
+    for (size_t i = 0; i < rowOps; i++)
+        rows.emplace_back("r" + to_string(i), "row task", CATEGORIES[i % 8], TaskStatus::Incomplete, 24,
+                          DeadlineSpan{0, 0, 1}, n + 1 + i);
+    bench.run("db.insertTask", n, rowOps, [&](size_t i) { db.insertTask(rows[i]); });
+    bench.run("db.updateTask", n, rowOps, [&](size_t i) { rows[i].status = TaskStatus::Complete; },
+              [&](size_t i) { db.updateTask(rows[i]); });
+    bench.run("db.deleteTask", n, rowOps, [&](size_t i) { db.deleteTask(rows[i].id); });
+}
+
+// Formatting cost per task line, written to a stream that discards it.
+static void benchOutput(Bench& bench, const vector<Task>& tasks) {
+    int n = static_cast<int>(tasks.size());
+    size_t ops = min(n, 200000);
+    struct NullBuffer : streambuf {
+        int overflow(int c) override { return c; }
+        streamsize xsputn(const char*, streamsize count) override { return count; }
+    } sink;
+    ostream out(&sink);
+    const pair<const char*, OutputFormat> formats[] = {
+        {"output.text", OutputFormat::Text}, {"output.tsv", OutputFormat::Tsv}, {"output.json", OutputFormat::JsonLines}};
+    for (const auto &format : formats) {
+        TaskWriter writer(out, format.second);
+        bench.run(format.first, n, ops, [&](size_t i) { writer.write(tasks[i], static_cast<int>(i) + 1); });
+    }
+}
+
+// LogStorage as the alternative to benchDatabase: startup load with a
+// replayed log, and appending a one-task change (synced, as in Main.cpp).
+static void benchLogStorage(Bench& bench, const vector<Task>& tasks, const string& dbPath) {
+    int n = static_cast<int>(tasks.size());
+    size_t repeats = max<size_t>(1, min<size_t>(20, 200000 / n));
+    size_t rowOps = min(n, 2000);
+    string base = dbPath + "-log";
+    removeLogStorage(base);
+    {
+        LogStorage storage(base);
+        storage.replaceAll(tasks);
+        bench.run("log.writeChanges", n, rowOps, [&](size_t i) {
+            Task task = tasks[i % n];
+            task.status = TaskStatus::Complete;
+            ChangeSet changes;
+            changes.emplace(task.id, std::move(task));
+            storage.writeChanges(changes);
+        });
+        bench.run("log.loadTasks", n, repeats, [&](size_t) {
+            if (static_cast<int>(storage.loadTasks().size()) != n)
+                throw runtime_error("loadTasks size mismatch");
+        });
+        bench.run("log.compact", n, 1, [&](size_t) { storage.compact(); });
+    }
+    removeLogStorage(base);
+}
+
+int main(int argc, char* argv[]) {
+    bool json = false;
+    vector<int> sizes = {1000, 100000, 1000000};
+    string dbPath = "bench_tasks.db";
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--json") {
+            json = true;
+        } else if (arg == "--sizes" && i + 1 < argc) {
+            sizes.clear();
+            stringstream list(argv[++i]);
+            string item;
+            while (getline(list, item, ','))
+                sizes.push_back(max(1, atoi(item.c_str())));
+        } else if (arg == "--db" && i + 1 < argc) {
+            dbPath = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--json] [--sizes 1000,100000,1000000] [--db bench_tasks.db]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    Bench bench(json);
+    mt19937 rng(42);
+    try {
+        for (int n : sizes) {
+            vector<Task> tasks = makeTasks(n, rng);
+            benchTree(bench, tasks, rng);
+            benchFlows(bench, tasks, dbPath);
+            benchOutput(bench, tasks);
+            benchLogStorage(bench, tasks, dbPath);
+            benchDatabase(bench, std::move(tasks), dbPath);
+        }
+    } catch (const exception& e) {
+        fprintf(stderr, "Benchmark failed: %s\n", e.what());
+        removeDatabase(dbPath);
+        return 1;
+    }
+    removeDatabase(dbPath);
+    return 0;
+}
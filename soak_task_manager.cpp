@@ -0,0 +1,1035 @@
+// Soak test for TaskStore over a WriteBehindJournal and DBManager, the stack
+// Main.cpp runs: a randomized mix of inserts, status updates, deletes,
+// searches and range lists, optionally at a fixed rate and next to reader
+// threads, with a latency histogram per operation.
+//
+//   g++ -std=c++17 -O2 soak_task_manager.cpp -o soak_task_manager -lsqlite3 -pthread
+//   ./soak_task_manager [--tasks 100000] [--ops 200000] [--seconds 0] [--rate 0]
+//                       [--mix insert=20,status=30,delete=10,search=30,list=10]
+//                       [--readers 0] [--hot-set 0] [--check-every 50000]
+//                       [--seed 42] [--db soak_tasks.db] [--json]
+//   ./soak_task_manager --scenarios
+//
+// With --rate each operation has a scheduled start and its latency is
+// measured from there, so a stall also counts against the operations queued
+// behind it. The writer keeps a model of every task's status and checks
+// each search against it. Every --check-every operations, and at the end,
+// the tree's invariants are checked; at the end the journal is flushed and
+// the table reread and compared with the store. Exits 1 on any mismatch.
+//
+// --scenarios instead runs fixed interleavings of the journal, store and
+// server that a random workload rarely hits, such as a write held back
+// while other threads read, and reports each as ok or FAIL.
+#include "TaskLogStorage.h"
+#include "TaskServer.h"
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <numeric>
+#include <poll.h>
+#include <random>
+#include <sstream>
+
+// Log-linear histogram in the style of HdrHistogram: 128 linear buckets up
+// to 128 ns, then 64 per power of two, so values are kept within 1.6%
+// whatever their size, in a fixed 30KB.
+class LatencyHistogram {
+private:
+    static const int SUB_BITS = 7;
+    static const uint64_t SUB = 1ULL << SUB_BITS;
+    static const uint64_t HALF = SUB / 2;
+
+    vector<uint64_t> counts;
+    uint64_t total;
+    uint64_t maxValue;
+    double sum;
+
+    static size_t bucketOf(uint64_t value) {
+        if (value < SUB)
+            return value;
+        int shift = 63 - __builtin_clzll(value) - (SUB_BITS - 1);
+        return SUB + (shift - 1) * HALF + ((value >> shift) - HALF);
+    }
+
+    // Largest value counted in bucket.
+    static uint64_t highestIn(size_t bucket) {
+        if (bucket < SUB)
+            return bucket;
+        int shift = static_cast<int>((bucket - SUB) / HALF) + 1;
+        uint64_t mantissa = (bucket - SUB) % HALF + HALF;
+        return ((mantissa + 1) << shift) - 1;
+    }
+
+public:
+    LatencyHistogram() : counts(SUB + (64 - SUB_BITS) * HALF), total(0), maxValue(0), sum(0) {}
+
+    void record(uint64_t ns) {
+        counts[bucketOf(ns)]++;
+        total++;
+        maxValue = max(maxValue, ns);
+        sum += ns;
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < counts.size(); i++)
+            counts[i] += other.counts[i];
+        total += other.total;
+        maxValue = max(maxValue, other.maxValue);
+        sum += other.sum;
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t largest() const { return maxValue; }
+    double mean() const { return total ? sum / total : 0; }
+
+    // Smallest bucket bound with at least fraction of the values at or below it.
+    uint64_t percentile(double fraction) const {
+        if (total == 0)
+            return 0;
+        uint64_t rank = max<uint64_t>(1, static_cast<uint64_t>(ceil(fraction * total)));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); i++) {
+            seen += counts[i];
+            if (seen >= rank)
+                return min(highestIn(i), maxValue);
+        }
+        return maxValue;
+    }
+};
+
+enum SoakOp { OP_INSERT, OP_STATUS, OP_DELETE, OP_SEARCH, OP_LIST, OP_COUNT };
+
+static const char* const OP_NAMES[] = {"insert", "status", "delete", "search", "list"};
+static const char* const CATEGORIES[] = {"Work", "Home", "Study", "Health", "Errands", "Finance", "Travel", "Misc"};
+static const int LIST_PAGE = 50;
+
+struct SoakOptions {
+    int tasks = 100000;
+    size_t ops = 200000;
+    double seconds = 0;
+    double rate = 0;
+    int mix[OP_COUNT] = {20, 30, 10, 30, 10};
+    int readers = 0;
+    size_t hotSet = 0;
+    size_t checkEvery = 50000;
+    unsigned seed = 42;
+    string dbPath = "soak_tasks.db";
+    bool json = false;
+    bool scenarios = false;
+};
+
+static void parseMix(const string& text, int mix[OP_COUNT]) {
+    fill(mix, mix + OP_COUNT, 0);
+    stringstream list(text);
+    string item;
+    while (getline(list, item, ',')) {
+        size_t equals = item.find('=');
+        int op = OP_COUNT;
+        for (int i = 0; i < OP_COUNT; i++) {
+            if (item.compare(0, equals, OP_NAMES[i]) == 0)
+                op = i;
+        }
+        if (equals == string::npos || op == OP_COUNT)
+            throw runtime_error("Bad --mix entry: " + item);
+        mix[op] = max(0, atoi(item.c_str() + equals + 1));
+    }
+    if (accumulate(mix, mix + OP_COUNT, 0) == 0)
+        throw runtime_error("--mix has no operations");
+}
+
+static Task makeTask(const string& id, mt19937& rng, long long now) {
+    long hours = rng() % 10000;
+    TaskStatus status = rng() % 4 == 0 ? TaskStatus::Complete : TaskStatus::Incomplete;
+    return Task(id, "soak task " + id, CATEGORIES[rng() % 8], status, hours, DeadlineSpan::fromHours(hours), 0,
+                now + hours * 3600LL);
+}
+
+static void removeDatabase(const string& path) {
+    remove(path.c_str());
+    remove((path + "-wal").c_str());
+    remove((path + "-shm").c_str());
+}
+
+// The writer's record of which tasks exist and their status. Insert, status
+// and delete pick tasks from here, and searches are checked against it.
+class TaskModel {
+private:
+    vector<string> ids;
+    vector<TaskStatus> statuses;
+    unordered_map<string, size_t> positions;
+
+public:
+    size_t size() const { return ids.size(); }
+    const string& at(size_t i) const { return ids[i]; }
+    TaskStatus statusAt(size_t i) const { return statuses[i]; }
+    void setStatus(size_t i, TaskStatus status) { statuses[i] = status; }
+
+    void add(const string& id, TaskStatus status) {
+        positions.emplace(id, ids.size());
+        ids.push_back(id);
+        statuses.push_back(status);
+    }
+
+    void removeAt(size_t i) {
+        positions.erase(ids[i]);
+        if (i + 1 != ids.size()) {
+            ids[i] = std::move(ids.back());
+            statuses[i] = statuses.back();
+            positions[ids[i]] = i;
+        }
+        ids.pop_back();
+        statuses.pop_back();
+    }
+
+    const TaskStatus* find(const string& id) const {
+        auto it = positions.find(id);
+        return it == positions.end() ? nullptr : &statuses[it->second];
+    }
+};
+
+static void runReader(const TaskStore& store, int maxId, unsigned seed, const atomic<bool>& done,
+                      LatencyHistogram* histograms) {
+    mt19937 rng(seed);
+    while (!done.load(memory_order_relaxed)) {
+        int op = rng() % 3;
+        auto start = chrono::steady_clock::now();
+        if (op == 0) {
+            string id = "t" + to_string(rng() % maxId);
+            optional<Task> task = store.search(id);
+            if (task && task->id != id)
+                throw runtime_error("search for " + id + " returned " + task->id);
+        } else if (op == 1) {
+            int first = 1 + static_cast<int>(rng() % max(1, store.size()));
+            store.range(first, first + LIST_PAGE - 1);
+        } else {
+            TaskQuery q;
+            q.category = CATEGORIES[rng() % 8];
+            q.status = TaskStatus::Incomplete;
+            store.query(q, LIST_PAGE);
+        }
+        auto stop = chrono::steady_clock::now();
+        histograms[op].record(chrono::duration_cast<chrono::nanoseconds>(stop - start).count());
+    }
+}
+
+static void report(const string& name, const LatencyHistogram& h, double seconds, bool json) {
+    if (h.count() == 0)
+        return;
+    double rate = seconds > 0 ? h.count() / seconds : 0;
+    if (json) {
+        printf("{\"operation\":\"%s\",\"count\":%llu,\"ops_per_sec\":%.1f,\"mean_ns\":%.0f,\"p50_ns\":%llu,"
+               "\"p90_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}\n",
+               name.c_str(), static_cast<unsigned long long>(h.count()), rate, h.mean(),
+               static_cast<unsigned long long>(h.percentile(0.5)), static_cast<unsigned long long>(h.percentile(0.9)),
+               static_cast<unsigned long long>(h.percentile(0.99)),
+               static_cast<unsigned long long>(h.percentile(0.999)), static_cast<unsigned long long>(h.largest()));
+    } else {
+        printf("%-14s %10llu %11.0f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", name.c_str(),
+               static_cast<unsigned long long>(h.count()), rate, h.mean() / 1e3, h.percentile(0.5) / 1e3,
+               h.percentile(0.9) / 1e3, h.percentile(0.99) / 1e3, h.percentile(0.999) / 1e3, h.largest() / 1e3);
+    }
+}
+
+static void checkStore(const TaskStore& store, const TaskModel& model) {
+    store.read([](const AVLTree& tree) { tree.checkInvariants(); });
+    if (static_cast<size_t>(store.size()) != model.size())
+        throw runtime_error("store has " + to_string(store.size()) + " tasks, model " + to_string(model.size()));
+}
+
+// Rereads the table and compares it with the store's tasks and priorities.
+static void checkPersisted(const TaskStore& store, const string& dbPath) {
+    vector<Task> tasks = store.listTasks();
+    for (size_t i = 0; i < tasks.size(); i++) {
+        if (tasks[i].priority != static_cast<int>(i) + 1)
+            throw runtime_error("task " + tasks[i].id + " listed at " + to_string(i + 1) + " has priority " +
+                                to_string(tasks[i].priority));
+    }
+    DBManager db(dbPath);
+    unordered_map<string, Task> stored;
+    for (auto &task : db.loadTasks())
+        stored.emplace(task.id, std::move(task));
+    if (stored.size() != tasks.size())
+        throw runtime_error("table has " + to_string(stored.size()) + " rows, store " + to_string(tasks.size()));
+    for (const auto &task : tasks) {
+        auto it = stored.find(task.id);
+        if (it == stored.end())
+            throw runtime_error("task " + task.id + " missing from the table");
+        const Task& row = it->second;
+        if (row.status != task.status || row.remainingHours != task.remainingHours ||
+            row.sequence != task.sequence || row.dueAt != task.dueAt || row.categoryId != task.categoryId ||
+            row.description != task.description)
+            throw runtime_error("table row differs for task " + task.id);
+    }
+}
+
+// Storage whose writes block while it is closed, for ordering scenarios the
+// random workload rarely hits. Changes are kept, and passed on to target if
+// one is given.
+class GatedStorage : public TaskStorage {
+private:
+    TaskStorage* target;
+    mutex gateMutex;
+    condition_variable changed;
+    bool open;
+    size_t entered;
+    ChangeSet committed;
+
+public:
+    explicit GatedStorage(TaskStorage* next = nullptr) : target(next), open(true), entered(0) {}
+
+    vector<Task> loadTasks() override {
+        unique_lock<mutex> lock(gateMutex);
+        changed.wait(lock, [this] { return open; });
+        return target ? target->loadTasks() : vector<Task>();
+    }
+
+    void writeChanges(const ChangeSet& changes) override {
+        unique_lock<mutex> lock(gateMutex);
+        entered++;
+        changed.notify_all();
+        changed.wait(lock, [this] { return open; });
+        if (target)
+            target->writeChanges(changes);
+        for (const auto &change : changes)
+            committed.insert_or_assign(change.first, change.second);
+    }
+
+    void close() {
+        lock_guard<mutex> lock(gateMutex);
+        open = false;
+    }
+
+    void release() {
+        lock_guard<mutex> lock(gateMutex);
+        open = true;
+        changed.notify_all();
+    }
+
+    // Waits until writes number count have started.
+    void waitForWrites(size_t count) {
+        unique_lock<mutex> lock(gateMutex);
+        changed.wait(lock, [&] { return entered >= count; });
+    }
+
+    optional<Task> find(const string& id) {
+        lock_guard<mutex> lock(gateMutex);
+        auto it = committed.find(id);
+        return it == committed.end() ? nullopt : it->second;
+    }
+};
+
+static void expect(bool condition, const string& what) {
+    if (!condition)
+        throw runtime_error(what);
+}
+
+// flush() waits for a batch the flusher already took, and returns only once
+// everything recorded before it is committed, in order.
+static void scenarioFlushWaitsForFlusher() {
+    GatedStorage storage;
+    WriteBehindJournal journal(storage, chrono::milliseconds(1));
+    mt19937 rng(1);
+    Task task = makeTask("A", rng, 0);
+
+    storage.close();
+    journal.recordUpsert(task);
+    storage.waitForWrites(1); // the flusher holds the only batch
+    atomic<bool> flushed(false);
+    thread flusher([&] {
+        journal.flush();
+        flushed = true;
+    });
+    this_thread::sleep_for(chrono::milliseconds(50));
+    bool early = flushed;
+    storage.release();
+    flusher.join();
+    expect(!early, "flush() returned while the flusher's batch was still being written");
+    expect(storage.find("A").has_value(), "flush() returned before the task was committed");
+
+    // Racing the flusher: after each flush() the latest state must be stored.
+    for (long hours = 1; hours <= 20000; hours++) {
+        task.remainingHours = hours;
+        journal.recordUpsert(task);
+        if (hours % 3 == 0) {
+            journal.flush();
+            optional<Task> stored = storage.find("A");
+            expect(stored && stored->remainingHours == hours,
+                   "after flush() the stored state is older than the last one recorded");
+        }
+    }
+}
+
+// Hot-set reads of cold storage see a delete whose write is still in
+// flight: the task is gone from search and size, and its ID is free again.
+static void scenarioHotSetReadsOwnDelete() {
+    const string path = "soak_scenario.db";
+    removeDatabase(path);
+    {
+        mt19937 rng(2);
+        Task done = makeTask("A", rng, 0);
+        done.status = TaskStatus::Complete;
+        done.sequence = 1;
+        Task open = makeTask("B", rng, 0);
+        open.status = TaskStatus::Incomplete;
+        open.sequence = 2;
+
+        DBManager db(path);
+        db.rebuildTasks({done, open});
+        GatedStorage storage(&db);
+        WriteBehindJournal journal(storage, chrono::milliseconds(1));
+        DBManager cold(path);
+        TaskStore store;
+        store.enableHotSet(cold, &journal, 1);
+        store.setJournal(&journal);
+
+        storage.close();
+        store.deleteTask("A"); // pages A in from cold storage, then deletes it
+        storage.waitForWrites(1);
+        optional<Task> found;
+        int size = -1;
+        atomic<bool> read(false);
+        thread reader([&] {
+            found = store.search("A");
+            size = store.size();
+            read = true;
+        });
+        this_thread::sleep_for(chrono::milliseconds(50));
+        bool early = read;
+        storage.release();
+        reader.join();
+        expect(!early, "cold reads did not wait for the journal");
+        expect(!found, "search found a task deleted before it");
+        expect(size == 1, "size is " + to_string(size) + " after deleting one of two tasks");
+        mt19937 rng2(3);
+        Task again = makeTask("A", rng2, 0);
+        store.insert(again);
+        expect(store.size() == 2, "reinserting a deleted ID failed");
+        store.setJournal(nullptr);
+    }
+    removeDatabase(path);
+}
+
+// Lets several shards share one GatedStorage.
+class StorageRef : public TaskStorage {
+private:
+    TaskStorage& target;
+
+public:
+    explicit StorageRef(TaskStorage& t) : target(t) {}
+    vector<Task> loadTasks() override { return target.loadTasks(); }
+    void writeChanges(const ChangeSet& changes) override { target.writeChanges(changes); }
+};
+
+// Storage that cannot be read, for load failures.
+class FailingStorage : public TaskStorage {
+public:
+    vector<Task> loadTasks() override { throw runtime_error("load failed"); }
+    void writeChanges(const ChangeSet&) override { throw runtime_error("write to a storage that failed to load"); }
+};
+
+// close() reports a failed final write and keeps the changes pending; the
+// destructor, which cannot throw, reports them on stderr.
+static void scenarioJournalCloseFails() {
+    FailingStorage storage;
+    mt19937 rng(10);
+    ostringstream errors;
+    bool threw = false;
+    size_t pending = 0;
+    streambuf* saved = cerr.rdbuf(errors.rdbuf());
+    {
+        WriteBehindJournal journal(storage);
+        journal.recordUpsert(makeTask("A", rng, 0));
+        try {
+            journal.close();
+        } catch (const runtime_error&) {
+            threw = true;
+        }
+        pending = journal.pendingCount();
+    }
+    cerr.rdbuf(saved);
+    expect(threw, "close() did not report the failed write");
+    expect(pending == 1, "close() dropped the unsaved change");
+    expect(errors.str().find("1 unsaved change(s) lost") != string::npos,
+           "the destructor did not report the lost change: " + errors.str());
+}
+
+// A shard whose load throws stays unloaded, keeps nothing of the failed
+// storage, and loads again on the next access.
+static void scenarioShardLoadRetries() {
+    GatedStorage storage;
+    int opened = 0;
+    TaskShards shards([&](const string&) -> unique_ptr<TaskStorage> {
+        if (opened++ == 0)
+            return unique_ptr<TaskStorage>(new FailingStorage());
+        return unique_ptr<TaskStorage>(new StorageRef(storage));
+    });
+    bool failed = false;
+    try {
+        shards.shard("retry");
+    } catch (const runtime_error&) {
+        failed = true;
+    }
+    expect(failed, "the failed load was not reported");
+    expect(!shards.loadedShard("retry"), "a failed load left the shard loaded");
+    shards.flush();
+
+    mt19937 rng(7);
+    TaskShard& shard = shards.shard("retry");
+    shard.store.insert(makeTask("A", rng, 0));
+    shards.flush();
+    expect(opened == 2, "the shard did not reopen its storage");
+    expect(storage.find("A").has_value(), "a write after the retried load was not committed");
+}
+
+// A task whose ID is already archived stays in the store: archiving it
+// again would write over the earlier task's archived copy.
+static void scenarioArchiveReusedId() {
+    const string path = "soak_scenario_archive.db";
+    removeDatabase(path);
+    {
+        long long now = time(nullptr);
+        DBManager archive(path);
+        TaskStore store;
+        ArchiveProfile profile;
+        profile.minAgeSeconds = 3600;
+        TaskArchiver archiver(store, archive, profile, false);
+        auto oldTask = [&](const string& description) {
+            return Task("X", description, "Work", TaskStatus::Complete, -48, DeadlineSpan::fromHours(0), 0,
+                        now - 48 * 3600LL);
+        };
+
+        store.insert(oldTask("first"));
+        expect(archiver.step(now) == 1, "the first task was not archived");
+        expect(!store.search("X"), "the archived task is still in the store");
+
+        store.insert(oldTask("second"));
+        store.deleteTask("X");
+        store.insert(oldTask("third"));
+        for (int i = 0; i < 3; i++)
+            expect(archiver.step(now) == 0, "a task reusing an archived ID was archived");
+        optional<Task> archived = archiver.find("X");
+        expect(archived && archived->description == "first", "the archived copy was overwritten or removed");
+        optional<Task> live = store.search("X");
+        expect(live && live->description == "third", "the task reusing the ID left the store");
+        expect(archiver.size() == 1, "the archive holds " + to_string(archiver.size()) + " tasks");
+    }
+    removeDatabase(path);
+}
+
+static int connectTo(uint16_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+        throw runtime_error(string("Can't connect: ") + strerror(errno));
+    return fd;
+}
+
+static void sendAll(int fd, const string& text) {
+    if (send(fd, text.data(), text.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(text.size()))
+        throw runtime_error("short send");
+}
+
+// Reads until lines complete lines arrived or timeoutMs passes without data.
+static string receiveLines(int fd, size_t lines, int timeoutMs) {
+    string text;
+    while (static_cast<size_t>(count(text.begin(), text.end(), '\n')) < lines) {
+        pollfd p{fd, POLLIN, 0};
+        if (poll(&p, 1, timeoutMs) <= 0)
+            break;
+        char buffer[4096];
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n <= 0)
+            break;
+        text.append(buffer, n);
+    }
+    return text;
+}
+
+// A client's write is answered only after its commit.
+static void scenarioServerAcksAfterCommit() {
+    GatedStorage storage;
+    TaskShards shards([&](const string&) { return unique_ptr<TaskStorage>(new StorageRef(storage)); });
+    TaskServer server(shards, TaskShards::DEFAULT_TEAM, 0);
+    int fd = connectTo(server.port());
+    sendAll(fd, "PING\n");
+    expect(receiveLines(fd, 1, 2000) == "OK\n", "no answer to PING");
+
+    storage.close();
+    sendAll(fd, "INSERT\tA\tsoak\tWork\t0\t0\t1\t0\n");
+    string early = receiveLines(fd, 1, 100);
+    storage.release();
+    string reply = early + receiveLines(fd, 1, 2000);
+    bool committed = storage.find("A").has_value();
+    close(fd);
+    expect(early.empty(), "reply arrived before the commit: " + early);
+    expect(reply.compare(0, 3, "OK ") == 0, "unexpected reply: " + reply);
+    expect(committed, "reply arrived but the task is not committed");
+}
+
+// TEAM for a team not loaded yet does not hold up other connections, only
+// the requests behind it on its own; teams outside the allow-list are refused.
+static void scenarioServerLoadsTeamsOffLoop() {
+    GatedStorage storage;
+    TaskShards shards([&](const string&) { return unique_ptr<TaskStorage>(new StorageRef(storage)); });
+    ServerProfile profile;
+    profile.teams = {"slow"};
+    TaskServer server(shards, TaskShards::DEFAULT_TEAM, 0, profile);
+    int loading = connectTo(server.port());
+    int other = connectTo(server.port());
+
+    sendAll(other, "TEAM\tstranger\n");
+    string refused = receiveLines(other, 1, 2000);
+    storage.close();
+    sendAll(loading, "TEAM\tslow\nPING\n");
+    this_thread::sleep_for(chrono::milliseconds(50));
+    sendAll(other, "PING\n");
+    string otherReply = receiveLines(other, 1, 1000);
+    string early = receiveLines(loading, 1, 50);
+    storage.release();
+    string reply = early + receiveLines(loading, 2, 2000);
+    close(loading);
+    close(other);
+    expect(refused.compare(0, 4, "ERR ") == 0, "a team outside the allow-list was accepted: " + refused);
+    expect(otherReply == "OK\n", "another connection waited for the team load");
+    expect(early.empty(), "TEAM answered before its team loaded: " + early);
+    expect(reply == "OK\nOK\n", "unexpected replies after the load: " + reply);
+}
+
+// A LogStorage opened over an existing log appends after it, even when
+// written to before any load, and past a torn tail.
+static void scenarioLogAppendsWithoutLoad() {
+    const string base = "soak_scenario_log";
+    auto removeFiles = [&] {
+        remove((base + ".snap").c_str());
+        remove((base + ".log").c_str());
+    };
+    removeFiles();
+    mt19937 rng(4);
+    auto writeOne = [&](const string& id, bool load) {
+        LogStorage log(base);
+        if (load)
+            log.loadTasks();
+        ChangeSet changes;
+        changes.emplace(id, makeTask(id, rng, 0));
+        log.writeChanges(changes);
+    };
+    writeOne("A", true);
+    writeOne("B", false);
+    FILE* file = fopen((base + ".log").c_str(), "ab");
+    fputs("torn", file); // half a batch header
+    fclose(file);
+    writeOne("C", false);
+    vector<Task> tasks = LogStorage(base).loadTasks();
+    removeFiles();
+    vector<string> ids;
+    for (const auto &task : tasks)
+        ids.push_back(task.id);
+    sort(ids.begin(), ids.end());
+    expect(ids == vector<string>({"A", "B", "C"}), "log holds " + to_string(ids.size()) + " of 3 tasks");
+}
+
+// A second LogStorage over a base path already open is refused without
+// touching the log, so it can neither cut off nor overwrite the first one's
+// batches; once the first is closed the base path opens again.
+static void scenarioLogRefusesSecondOpen() {
+    const string base = "soak_scenario_log_lock";
+    auto removeFiles = [&] {
+        remove((base + ".snap").c_str());
+        remove((base + ".log").c_str());
+    };
+    removeFiles();
+    mt19937 rng(8);
+    auto writeOne = [&](LogStorage& log, const string& id) {
+        ChangeSet changes;
+        changes.emplace(id, makeTask(id, rng, 0));
+        log.writeChanges(changes);
+    };
+    {
+        LogStorage first(base);
+        writeOne(first, "A");
+        bool refused = false;
+        try {
+            LogStorage second(base);
+        } catch (const runtime_error&) {
+            refused = true;
+        }
+        expect(refused, "a second LogStorage opened a log in use");
+        writeOne(first, "B");
+    }
+    vector<Task> tasks = LogStorage(base).loadTasks();
+    removeFiles();
+    expect(tasks.size() == 2, "log holds " + to_string(tasks.size()) + " of 2 tasks");
+}
+
+// "id:status" per task in priority order, with each priority checked.
+static string describeTasks(const vector<Task>& tasks) {
+    string text;
+    for (size_t i = 0; i < tasks.size(); i++) {
+        if (tasks[i].priority != static_cast<int>(i) + 1)
+            throw runtime_error("priority " + to_string(tasks[i].priority) + " at position " + to_string(i + 1));
+        text += tasks[i].id + ":" + statusName(tasks[i].status) + " ";
+    }
+    return text;
+}
+
+// Snapshots keep their version while the store changes, follow the tree's
+// order policy, and undo puts the tree, the snapshot and the journal back.
+static void scenarioSnapshotsAndUndo() {
+    mt19937 rng(5);
+    vector<Task> tasks;
+    for (int i = 0; i < 200; i++) {
+        tasks.push_back(makeTask("t" + to_string(i), rng, 0));
+        tasks.back().sequence = i + 1;
+    }
+    TaskStore store;
+    store.setOrder(TaskOrder::parse("category:Work=3,Home=2"));
+    store.rebuild(tasks);
+    store.enableSnapshots(1000);
+    ChangeRecorder recorder;
+    store.setJournal(&recorder);
+    auto matchesTree = [&](const string& when) {
+        store.read([](const AVLTree& tree) { tree.checkInvariants(); });
+        shared_ptr<const TaskSnapshot> snapshot = store.snapshot();
+        expect(describeTasks(snapshot->range(1, INT_MAX)) == describeTasks(store.listTasks()),
+               "snapshot differs from the tree " + when);
+    };
+    matchesTree("after enableSnapshots");
+
+    string before = describeTasks(store.listTasks());
+    shared_ptr<const TaskSnapshot> old = store.snapshot();
+    store.insert(makeTask("new", rng, 0));
+    store.updateTaskStatus("t1", store.search("t1")->isComplete() ? TaskStatus::Incomplete : TaskStatus::Complete);
+    store.deleteTask("t2");
+    expect(describeTasks(old->range(1, INT_MAX)) == before, "a snapshot changed under later writes");
+    matchesTree("after writes");
+    expect(store.undo(3) == 3, "undo(3) did not undo three changes");
+    expect(describeTasks(store.listTasks()) == before, "undo did not restore the tasks");
+    expect(recorder.changes.count("new") && !recorder.changes["new"] && recorder.changes["t2"],
+           "the journal did not see the undo");
+    matchesTree("after undo");
+
+    // A write that rekeys every task is one version and one undo step.
+    auto hoursOf = [](const vector<Task>& tasks) {
+        string text;
+        for (const auto &task : tasks)
+            text += task.id + ":" + to_string(task.remainingHours) + " ";
+        return text;
+    };
+    string hoursBefore = hoursOf(store.listTasks());
+    before = describeTasks(store.listTasks());
+    old = store.snapshot();
+    size_t moved = store.write([](AVLTree& tree) { return tree.recomputeDeadlines(time(nullptr) + 400 * 24 * 3600LL); });
+    expect(moved > 1, "recomputeDeadlines changed " + to_string(moved) + " task(s)");
+    matchesTree("after recomputeDeadlines");
+    expect(describeTasks(old->range(1, INT_MAX)) == before, "a snapshot changed under a bulk write");
+    expect(store.undo(1) == 1, "undo(1) did not undo the bulk write");
+    expect(describeTasks(store.listTasks()) == before && hoursOf(store.listTasks()) == hoursBefore,
+           "undo(1) did not revert the whole bulk write");
+    matchesTree("after undoing recomputeDeadlines");
+
+    // Random changes with undos in between.
+    int nextId = 200;
+    for (int round = 0; round < 40; round++) {
+        for (int op = 0; op < 25; op++) {
+            vector<Task> current = store.listTasks();
+            int kind = rng() % 3;
+            if (kind == 0 || current.empty()) {
+                store.insert(makeTask("t" + to_string(nextId++), rng, 0));
+            } else {
+                const Task& task = current[rng() % current.size()];
+                if (kind == 1)
+                    store.updateTaskStatus(task.id, task.isComplete() ? TaskStatus::Incomplete : TaskStatus::Complete);
+                else
+                    store.deleteTask(task.id);
+            }
+        }
+        store.undo(rng() % 30);
+        matchesTree("after round " + to_string(round));
+    }
+}
+
+// An undo whose restore fails puts back the tasks it already restored and
+// keeps the published version and its history, so it can be retried.
+static void scenarioUndoRestoreFails() {
+    mt19937 rng(9);
+    vector<Task> tasks;
+    for (const char* id : {"A", "B", "C"})
+        tasks.push_back(makeTask(id, rng, 0));
+    VersionedTaskTree versions(10);
+    versions.reset(tasks, TaskOrder());
+    for (const char* id : {"A", "B"}) {
+        Task changed = *versions.snapshot()->search(id);
+        changed.description = "changed";
+        versions.recordUpsert(changed);
+    }
+    versions.recordDelete("C");
+    shared_ptr<const TaskSnapshot> before = versions.snapshot();
+
+    // The tree undo would restore, as id -> description ("" once deleted).
+    map<string, string> tree = {{"A", "changed"}, {"B", "changed"}};
+    bool failing = true;
+    auto restore = [&](const string& id, const Task* state) {
+        if (failing && id == "B")
+            throw runtime_error("storage error");
+        if (state)
+            tree[id] = state->description;
+        else
+            tree.erase(id);
+    };
+    bool threw = false;
+    try {
+        versions.undo(3, restore);
+    } catch (const runtime_error&) {
+        threw = true;
+    }
+    expect(threw, "the failed restore was not reported");
+    expect(versions.snapshot() == before, "a failed undo published its target version");
+    expect(versions.undoDepth() == 3, "a failed undo dropped history");
+    expect(tree == map<string, string>({{"A", "changed"}, {"B", "changed"}}),
+           "a failed undo left a restored task behind");
+
+    failing = false;
+    expect(versions.undo(3, restore) == 3, "the retried undo did not undo three versions");
+    expect(tree.size() == 3 && tree["A"] == "soak task A" && tree["C"] == "soak task C",
+           "the retried undo did not restore the tasks");
+    expect(versions.snapshot()->search("A")->description == "soak task A", "the retried undo did not publish");
+}
+
+static int runScenarios() {
+    static const pair<const char*, void (*)()> SCENARIOS[] = {
+        {"flush waits for the flusher", scenarioFlushWaitsForFlusher},
+        {"hot set reads its own delete", scenarioHotSetReadsOwnDelete},
+        {"server acks after commit", scenarioServerAcksAfterCommit},
+        {"log appends without a load", scenarioLogAppendsWithoutLoad},
+        {"log refuses a second open", scenarioLogRefusesSecondOpen},
+        {"snapshots and undo", scenarioSnapshotsAndUndo},
+        {"undo keeps its history when a restore fails", scenarioUndoRestoreFails},
+        {"server loads teams off the event loop", scenarioServerLoadsTeamsOffLoop},
+        {"shard load retries after a failure", scenarioShardLoadRetries},
+        {"journal close reports a failed write", scenarioJournalCloseFails},
+        {"archive keeps a reused ID's earlier task", scenarioArchiveReusedId},
+    };
+    int failures = 0;
+    for (const auto &scenario : SCENARIOS) {
+        try {
+            scenario.second();
+            printf("ok    %s\n", scenario.first);
+        } catch (const exception& e) {
+            printf("FAIL  %s: %s\n", scenario.first, e.what());
+            failures++;
+        }
+        fflush(stdout);
+    }
+    return failures ? 1 : 0;
+}
+
+static int runSoak(const SoakOptions& options) {
+    mt19937 rng(options.seed);
+    long long now = time(nullptr);
+    TaskModel model;
+    vector<Task> tasks;
+    tasks.reserve(options.tasks);
+    for (int i = 0; i < options.tasks; i++) {
+        tasks.push_back(makeTask("t" + to_string(i), rng, now));
+        tasks.back().sequence = i + 1;
+        model.add(tasks.back().id, tasks.back().status);
+    }
+
+    removeDatabase(options.dbPath);
+    DBManager db(options.dbPath);
+    db.rebuildTasks(tasks);
+    WriteBehindJournal journal(db);
+    TaskStore store;
+    unique_ptr<DBManager> cold;
+    if (options.hotSet > 0) {
+        cold.reset(new DBManager(options.dbPath));
+        store.enableHotSet(*cold, &journal, options.hotSet);
+    } else {
+        store.rebuild(std::move(tasks));
+    }
+    store.setJournal(&journal);
+
+    int totalWeight = accumulate(options.mix, options.mix + OP_COUNT, 0);
+    LatencyHistogram histograms[OP_COUNT];
+    vector<LatencyHistogram> readerHistograms(options.readers * 3);
+    atomic<bool> done(false);
+    atomic<bool> readerFailed(false);
+    vector<thread> readers;
+    for (int r = 0; r < options.readers; r++) {
+        readers.emplace_back([&, r] {
+            try {
+                runReader(store, options.tasks, options.seed + r + 1, done, &readerHistograms[r * 3]);
+            } catch (const exception& e) {
+                fprintf(stderr, "Reader %d failed: %s\n", r, e.what());
+                readerFailed = true;
+            }
+        });
+    }
+
+    int nextId = options.tasks;
+    size_t searchMisses = 0;
+    auto begin = chrono::steady_clock::now();
+    auto period = options.rate > 0 ? chrono::duration<double>(1.0 / options.rate) : chrono::duration<double>(0);
+    size_t op = 0;
+    int failure = 0;
+    try {
+        for (; op < options.ops && !readerFailed; op++) {
+            auto intended = begin + chrono::duration_cast<chrono::steady_clock::duration>(period * op);
+            if (options.rate > 0)
+                this_thread::sleep_until(intended);
+            if (options.seconds > 0 && chrono::steady_clock::now() - begin >= chrono::duration<double>(options.seconds))
+                break;
+
+            int pick = rng() % totalWeight, kind = 0;
+            while (pick >= options.mix[kind])
+                pick -= options.mix[kind++];
+            if ((kind == OP_STATUS || kind == OP_DELETE) && model.size() == 0)
+                kind = OP_INSERT;
+
+            // Chosen outside the timed section.
+            size_t index = model.size() ? rng() % model.size() : 0;
+            optional<Task> fresh;
+            string id;
+            if (kind == OP_INSERT)
+                fresh = makeTask("t" + to_string(nextId++), rng, now);
+            else if (kind == OP_SEARCH)
+                id = rng() % 10 == 0 || model.size() == 0 ? "missing" + to_string(op) : model.at(index);
+            int first = 1 + static_cast<int>(rng() % max<size_t>(1, model.size()));
+
+            auto start = options.rate > 0 ? intended : chrono::steady_clock::now();
+            if (kind == OP_INSERT) {
+                string newId = fresh->id;
+                TaskStatus status = fresh->status;
+                store.insert(std::move(*fresh));
+                model.add(newId, status);
+            } else if (kind == OP_STATUS) {
+                TaskStatus next =
+                    model.statusAt(index) == TaskStatus::Complete ? TaskStatus::Incomplete : TaskStatus::Complete;
+                store.updateTaskStatus(model.at(index), next);
+                model.setStatus(index, next);
+            } else if (kind == OP_DELETE) {
+                store.deleteTask(model.at(index));
+                model.removeAt(index);
+            } else if (kind == OP_SEARCH) {
+                optional<Task> task = store.search(id);
+                const TaskStatus* expected = model.find(id);
+                if (!expected)
+                    searchMisses++;
+                if (task.has_value() != (expected != nullptr) || (task && task->status != *expected))
+                    throw runtime_error("search for " + id + " disagrees with the model");
+            } else {
+                vector<Task> page = store.range(first, first + LIST_PAGE - 1);
+                size_t expected = min<size_t>(LIST_PAGE, model.size() - first + 1);
+                if (page.size() != expected)
+                    throw runtime_error("range from " + to_string(first) + " returned " + to_string(page.size()) +
+                                        " tasks, expected " + to_string(expected));
+            }
+            auto stop = chrono::steady_clock::now();
+            histograms[kind].record(chrono::duration_cast<chrono::nanoseconds>(stop - start).count());
+
+            if (options.checkEvery && (op + 1) % options.checkEvery == 0)
+                checkStore(store, model);
+        }
+    } catch (const runtime_error& e) {
+        fprintf(stderr, "Operation %zu failed: %s\n", op, e.what());
+        failure = 1;
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    done = true;
+    for (auto &reader : readers)
+        reader.join();
+    if (readerFailed)
+        failure = 1;
+
+    if (!options.json)
+        printf("%-14s %10s %11s %10s %10s %10s %10s %10s %10s\n", "operation", "count", "ops/sec", "mean (us)",
+               "p50 (us)", "p90 (us)", "p99 (us)", "p99.9 (us)", "max (us)");
+    LatencyHistogram all;
+    for (int kind = 0; kind < OP_COUNT; kind++) {
+        report(OP_NAMES[kind], histograms[kind], seconds, options.json);
+        all.merge(histograms[kind]);
+    }
+    report("all", all, seconds, options.json);
+    static const char* const READER_NAMES[] = {"reader.search", "reader.range", "reader.query"};
+    for (int kind = 0; kind < 3; kind++) {
+        LatencyHistogram merged;
+        for (int r = 0; r < options.readers; r++)
+            merged.merge(readerHistograms[r * 3 + kind]);
+        report(READER_NAMES[kind], merged, seconds, options.json);
+    }
+    fflush(stdout);
+
+    if (failure)
+        return 1;
+    try {
+        checkStore(store, model);
+        journal.flush();
+        checkPersisted(store, options.dbPath);
+    } catch (const runtime_error& e) {
+        fprintf(stderr, "Validation failed: %s\n", e.what());
+        return 1;
+    }
+    if (!options.json)
+        printf("OK: %zu operations, %zu tasks left, %zu searches for missing IDs; invariants and table verified\n",
+               op, model.size(), searchMisses);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    SoakOptions options;
+    try {
+        for (int i = 1; i < argc; i++) {
+            string arg = argv[i];
+            bool hasValue = i + 1 < argc;
+            if (arg == "--json") {
+                options.json = true;
+            } else if (arg == "--scenarios") {
+                options.scenarios = true;
+            } else if (arg == "--tasks" && hasValue) {
+                options.tasks = max(0, atoi(argv[++i]));
+            } else if (arg == "--ops" && hasValue) {
+                options.ops = strtoull(argv[++i], nullptr, 10);
+            } else if (arg == "--seconds" && hasValue) {
+                options.seconds = atof(argv[++i]);
+            } else if (arg == "--rate" && hasValue) {
+                options.rate = atof(argv[++i]);
+            } else if (arg == "--mix" && hasValue) {
+                parseMix(argv[++i], options.mix);
+            } else if (arg == "--readers" && hasValue) {
+                options.readers = max(0, atoi(argv[++i]));
+            } else if (arg == "--hot-set" && hasValue) {
+                options.hotSet = strtoull(argv[++i], nullptr, 10);
+            } else if (arg == "--check-every" && hasValue) {
+                options.checkEvery = strtoull(argv[++i], nullptr, 10);
+            } else if (arg == "--seed" && hasValue) {
+                options.seed = static_cast<unsigned>(strtoul(argv[++i], nullptr, 10));
+            } else if (arg == "--db" && hasValue) {
+                options.dbPath = argv[++i];
+            } else {
+                fprintf(stderr,
+                        "Usage: %s [--tasks N] [--ops N] [--seconds S] [--rate OPS_PER_SEC]\n"
+                        "          [--mix insert=20,status=30,delete=10,search=30,list=10] [--readers N]\n"
+                        "          [--hot-set N] [--check-every N] [--seed N] [--db soak_tasks.db] [--json]\n"
+                        "       %s --scenarios\n",
+                        argv[0], argv[0]);
+                return 1;
+            }
+        }
+    } catch (const runtime_error& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+
+    int result;
+    try {
+        result = options.scenarios ? runScenarios() : runSoak(options);
+    } catch (const exception& e) {
+        fprintf(stderr, "Soak test failed: %s\n", e.what());
+        result = 1;
+    }
+    removeDatabase(options.dbPath);
+    return result;
+}